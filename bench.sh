@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the firmware tools on synthetic images.
+#
+# Usage: ./bench.sh [size_mb ...]
+#
+# Normally run through "make bench", which also builds the benchtime
+# helper the commands are timed with.
+#
+# For every size, fwgen generates H4, H3+ and romfs images of that many
+# megabytes, and each tool is timed on them. romfs offsets are 32-bit
+# signed, so romfs images stop at 2000 MB. The section index cache is
+# bypassed, so every run pays for a full scan. Scratch files go in a
+# fresh directory created under $BENCH_DIR (default: $TMPDIR or /tmp),
+# which needs about four times the largest size in free space. Only that
+# directory is removed afterwards.
+#
+
+set -e
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+SIZES=${*:-16}
+WORK=$(mktemp -d "${BENCH_DIR:-${TMPDIR:-/tmp}}/gopro-fw-bench.XXXXXX")
+
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+FWINDEX_DIR="$WORK/index"
+export FWINDEX_DIR
+
+# run <label> <bytes> <command...>: time the command, print seconds and MB/s.
+# date +%N is GNU only, so the timing is done by benchtime.
+run() {
+	label=$1
+	bytes=$2
+	shift 2
+
+	if ! secs=$("$TOOLS/benchtime" "$WORK/last.log" "$@"); then
+		echo "$label: FAILED (see below)"
+		tail -5 "$WORK/last.log"
+		exit 1
+	fi
+
+	awk -v l="$label" -v b="$bytes" -v s="$secs" 'BEGIN {
+		printf "  %-34s %9.3f s %10.1f MB/s\n", l, s, (s > 0 ? b / 1048576 / s : 0)
+	}'
+}
+
+size_of() {
+	wc -c < "$1" | tr -d ' '
+}
+
+for mb in $SIZES; do
+	echo "== ${mb} MB images"
+
+	rm -rf "$WORK/img" "$WORK/h4" "$WORK/h3" "$WORK/romfs"
+	mkdir -p "$WORK/img" "$WORK/h4" "$WORK/h3"
+	cd "$WORK"
+
+	run "fwgen h4" $((mb * 1048576)) "$TOOLS/fwgen" h4 img/h4.bin "$mb"
+	run "fwgen h3plus" $((mb * 1048576)) "$TOOLS/fwgen" h3plus img/h3.bin "$mb"
+	rom_mb=$((mb > 2000 ? 2000 : mb))
+	run "fwgen romfs" $((rom_mb * 1048576)) "$TOOLS/fwgen" romfs img/romfs.bin "$rom_mb"
+
+	h4=$(size_of img/h4.bin)
+	h3=$(size_of img/h3.bin)
+	rom=$(size_of img/romfs.bin)
+
+	run "fwparser" "$h4" "$TOOLS/fwparser" --revalidate img/h4.bin
+
+	cd "$WORK/h4"
+	run "fwunpacker" "$h4" "$TOOLS/fwunpacker" --revalidate ../img/h4.bin
+	rm -f section_*
+	run "fwunpacker -j 0" "$h4" "$TOOLS/fwunpacker" --revalidate -j 0 ../img/h4.bin
+	cd "$WORK/h3"
+	run "fwunpacker -j 0 (h3plus)" "$h3" "$TOOLS/fwunpacker" --revalidate -j 0 ../img/h3.bin
+	cd "$WORK"
+
+	run "h4-section-patch" "$h4" "$TOOLS/h4-section-patch" --revalidate \
+		img/h4.bin h4/section_1 1 img/h4-patched.bin
+	run "h4-section-patch --stream" "$h4" "$TOOLS/h4-section-patch" --revalidate --stream \
+		img/h4.bin h4/section_1 1 img/h4-patched.bin
+	run "h3plus-section-patch" "$h3" "$TOOLS/h3plus-section-patch" --revalidate \
+		img/h3.bin h3/section_1 1 img/h3-patched.bin
+	run "h3plus-section-patch --stream" "$h3" "$TOOLS/h3plus-section-patch" --revalidate --stream \
+		img/h3.bin h3/section_1 1 img/h3-patched.bin
+	rm -rf h4 h3 img/h4-patched.bin img/h3-patched.bin
+
+	run "goprom --extract-all" "$rom" "$TOOLS/goprom" --extract-all img/romfs.bin romfs
+	run "goprom --build" "$rom" "$TOOLS/goprom" --build romfs img/romfs-new.bin
+
+	rm -rf img romfs
+done
@@ -0,0 +1,93 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Timer for bench.sh. Neither date +%N nor /usr/bin/time is available
+ * everywhere, so the benchmark runs each command through this instead.
+ * The command's output goes to logfile, its elapsed wall clock time in
+ * seconds to stdout, and its exit status is passed on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+static double wall_time(void);
+static double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	double start;
+	pid_t pid;
+	int status, fd;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s logfile command [args...]\n", argv[0]);
+		return 127;
+	}
+
+	start = wall_time();
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return 127;
+	}
+
+	if (pid == 0) {
+		fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(argv[1]);
+			_exit(127);
+		}
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+
+		fd = open("/dev/null", O_RDONLY);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+
+		execvp(argv[2], argv + 2);
+		perror(argv[2]);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return 127;
+	}
+
+	printf("%.6f\n", wall_time() - start);
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 127;
+}
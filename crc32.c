@@ -2,37 +2,181 @@
  * CRC32 implementation from RFC1952
  *
  * http://www.faqs.org/rfcs/rfc1952.html
+ *
+ * The byte-at-a-time loop from the RFC has been replaced with a
+ * slicing-by-8 kernel, which consumes eight bytes per iteration using
+ * eight precomputed tables (see crc32_table.h).
+ *
+ * On x86 hosts with PCLMULQDQ the bulk of the buffer is instead folded
+ * with carry-less multiplies, as described in Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The instruction is detected at runtime, so the same binary still runs
+ * on CPUs without it.
  */
 
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32_PCLMUL 1
+#include <immintrin.h>
+#endif
+
 #include "crc32.h"
+#include "crc32_table.h"
+#include "workqueue.h"
+
+static uint32_t crc32_slice8(uint32_t c, const unsigned char *buf, size_t len);
+static uint32_t crc32_slice8(uint32_t c, const unsigned char *buf, size_t len)
+{
+	uint32_t lo, hi;
+
+	/* Align to 8 bytes so the main loop runs over whole words */
+	while (len && ((uintptr_t) buf & 7)) {
+		c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		lo = c ^ ((uint32_t) buf[0] <<  0 | (uint32_t) buf[1] <<  8 |
+			  (uint32_t) buf[2] << 16 | (uint32_t) buf[3] << 24);
+		hi =     ((uint32_t) buf[4] <<  0 | (uint32_t) buf[5] <<  8 |
+			  (uint32_t) buf[6] << 16 | (uint32_t) buf[7] << 24);
+
+		c = crc_table[7][(lo >>  0) & 0xff] ^
+		    crc_table[6][(lo >>  8) & 0xff] ^
+		    crc_table[5][(lo >> 16) & 0xff] ^
+		    crc_table[4][(lo >> 24) & 0xff] ^
+		    crc_table[3][(hi >>  0) & 0xff] ^
+		    crc_table[2][(hi >>  8) & 0xff] ^
+		    crc_table[1][(hi >> 16) & 0xff] ^
+		    crc_table[0][(hi >> 24) & 0xff];
+
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = crc_table[0][(c ^ *buf++) & 0xff] ^ (c >> 8);
 
-/* Table of CRCs of all 8-bit messages. */
-static unsigned long crc_table[256];
+	return c;
+}
 
-/* Flag: has the table been computed? Initially false. */
-static int crc_table_computed = 0;
+#ifdef HAVE_CRC32_PCLMUL
+/*
+ * Folding constants for the reflected 0xedb88320 polynomial:
+ * k1k2 fold by 512 bits, k3k4 by 128 bits, k5 reduces 96 to 64 bits and
+ * poly holds the Barrett reduction constants (P' and mu).
+ */
+static const uint64_t crc_k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4ULL, 0x01c6e41596ULL };
+static const uint64_t crc_k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0ULL, 0x00ccaa009eULL };
+static const uint64_t crc_k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124ULL, 0x0000000000ULL };
+static const uint64_t crc_poly[2] __attribute__((aligned(16))) = { 0x01db710641ULL, 0x01f7011641ULL };
 
-/* Make the table for a fast CRC. */
-static void make_crc_table(void);
-static void make_crc_table(void)
+/*
+ * Fold len bytes (len >= 64, multiple of 16) into the unconditioned
+ * crc c and return the reduced 32-bit result.
+ */
+static uint32_t crc32_pclmul(uint32_t c, const unsigned char *buf, size_t len)
+	__attribute__((target("pclmul,sse4.1")));
+static uint32_t crc32_pclmul(uint32_t c, const unsigned char *buf, size_t len)
 {
-	unsigned long c;
-
-	int n, k;
-	for (n = 0; n < 256; n++) {
-		c = (unsigned long) n;
-		for (k = 0; k < 8; k++) {
-			if (c & 1) {
-				c = 0xedb88320L ^ (c >> 1);
-			} else {
-				c = c >> 1;
-			}
-		}
-		crc_table[n] = c;
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int) c));
+	x0 = _mm_load_si128((const __m128i *) crc_k1k2);
+
+	buf += 64;
+	len -= 64;
+
+	/* Fold four 128-bit lanes in parallel, 64 bytes per iteration */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *) (buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *) (buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *) (buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *) (buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *) crc_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Remaining 16-byte blocks */
+	while (len >= 16) {
+		x2 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2),
+				   _mm_loadu_si128((const __m128i *) buf));
+		buf += 16;
+		len -= 16;
 	}
-	crc_table_computed = 1;
+
+	/* Fold 128 bits down to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *) crc_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction down to 32 bits */
+	x0 = _mm_load_si128((const __m128i *) crc_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (uint32_t) _mm_extract_epi32(x1, 1);
 }
 
+static int crc32_have_pclmul(void);
+static int crc32_have_pclmul(void)
+{
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+#endif /* HAVE_CRC32_PCLMUL */
+
 /*
    Update a running crc with the bytes buf[0..len-1] and return
  the updated crc. The crc should be initialized to zero. Pre- and
@@ -42,28 +186,155 @@ static void make_crc_table(void)
    unsigned long crc = 0L;
 
    while (read_buffer(buffer, length) != EOF) {
-     crc = update_crc(crc, buffer, length);
+     crc = crc32_update(crc, buffer, length);
    }
    if (crc != original_crc) error();
 */
-static unsigned long update_crc(unsigned long crc,
-                unsigned char *buf, int len);
-static unsigned long update_crc(unsigned long crc,
-                unsigned char *buf, int len)
+unsigned long crc32_update(unsigned long crc, const unsigned char *buf, size_t len)
 {
-	unsigned long c = crc ^ 0xffffffffL;
-	int n;
+	uint32_t c = (uint32_t) crc ^ 0xffffffffUL;
+#ifdef HAVE_CRC32_PCLMUL
+	size_t bulk;
 
-	if (!crc_table_computed)
-		make_crc_table();
-	for (n = 0; n < len; n++) {
-		c = crc_table[(c ^ buf[n]) & 0xff] ^ (c >> 8);
+	if (len >= 256 && crc32_have_pclmul()) {
+		bulk = len & ~(size_t) 15;
+		c = crc32_pclmul(c, buf, bulk);
+		buf += bulk;
+		len -= bulk;
 	}
-	return c ^ 0xffffffffL;
+#endif
+
+	c = crc32_slice8(c, buf, len);
+
+	return c ^ 0xffffffffUL;
 }
 
 /* Return the CRC of the bytes buf[0..len-1]. */
-unsigned long crc32(unsigned char *buf, int len)
+unsigned long crc32(const unsigned char *buf, size_t len)
 {
-	return update_crc(0L, buf, len);
+	if (!len)
+		return 0L;
+
+	return crc32_update(0L, buf, len);
+}
+
+/* Multiply a and b modulo the CRC polynomial (both reflected). */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b);
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t) 1 << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ 0xedb88320UL : b >> 1;
+	}
+	return p;
+}
+
+/* Return x^(n * 2^k) modulo the CRC polynomial. */
+static uint32_t crc32_x2nmodp(size_t n, unsigned int k);
+static uint32_t crc32_x2nmodp(size_t n, unsigned int k)
+{
+	uint32_t p = (uint32_t) 1 << 31;	/* x^0 == 1 */
+
+	while (n) {
+		if (n & 1)
+			p = crc32_multmodp(crc_x2n_table[k & 31], p);
+		n >>= 1;
+		k++;
+	}
+	return p;
+}
+
+/*
+ * Given crc1 = CRC(A) and crc2 = CRC(B), return CRC(A || B), where len2
+ * is the length of B. Runs in O(log len2), without touching the data.
+ */
+unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, size_t len2)
+{
+	return crc32_multmodp(crc32_x2nmodp(len2, 3), (uint32_t) crc1) ^ (uint32_t) crc2;
+}
+
+/*
+ * crc is the CRC of a message containing some range whose CRC was
+ * old_crc, followed by tail_len more bytes. Return the CRC of the same
+ * message after that range is overwritten with data of the same length
+ * whose CRC is new_crc. Because the CRC is affine in its input, only the
+ * difference between the two ranges matters, shifted past the tail.
+ */
+unsigned long crc32_replace(unsigned long crc, unsigned long old_crc,
+			    unsigned long new_crc, size_t tail_len)
+{
+	return crc ^ crc32_combine(old_crc ^ new_crc, 0L, tail_len);
+}
+
+/*
+ * Parallel CRC of several independent buffers. Every buffer is cut into
+ * CRC32_CHUNK sized pieces, the pieces are CRC'd on a thread pool and the
+ * partial results are stitched back together with crc32_combine().
+ */
+#define CRC32_CHUNK	(4 * 1024 * 1024)
+
+struct crc32_chunk {
+	const unsigned char *buf;
+	size_t len;
+	unsigned long crc;
+};
+
+static int crc32_chunk_work(void *ctx, int job);
+static int crc32_chunk_work(void *ctx, int job)
+{
+	struct crc32_chunk *chunk = (struct crc32_chunk *) ctx + job;
+
+	chunk->crc = crc32_update(0L, chunk->buf, chunk->len);
+	return 0;
+}
+
+/* Fill in jobs[i].crc for every job. Returns 0 on success. */
+int crc32_parallel(struct crc32_job *jobs, int njobs)
+{
+	struct crc32_chunk *chunks;
+	size_t nchunks = 0, pos;
+	int i, c, ret;
+
+	for (i = 0; i < njobs; i++)
+		nchunks += (jobs[i].len + CRC32_CHUNK - 1) / CRC32_CHUNK;
+
+	chunks = calloc(nchunks ? nchunks : 1, sizeof(*chunks));
+	if (!chunks) {
+		/* Out of memory; still produce correct results, just slowly */
+		for (i = 0; i < njobs; i++)
+			jobs[i].crc = crc32_update(0L, jobs[i].buf, jobs[i].len);
+		return 0;
+	}
+
+	c = 0;
+	for (i = 0; i < njobs; i++) {
+		for (pos = 0; pos < jobs[i].len; pos += CRC32_CHUNK) {
+			chunks[c].buf = jobs[i].buf + pos;
+			chunks[c].len = jobs[i].len - pos;
+			if (chunks[c].len > CRC32_CHUNK)
+				chunks[c].len = CRC32_CHUNK;
+			c++;
+		}
+	}
+
+	ret = work_run(0, nchunks, crc32_chunk_work, chunks);
+
+	c = 0;
+	for (i = 0; i < njobs; i++) {
+		jobs[i].crc = 0L;
+		for (pos = 0; pos < jobs[i].len; pos += CRC32_CHUNK) {
+			jobs[i].crc = crc32_combine(jobs[i].crc, chunks[c].crc, chunks[c].len);
+			c++;
+		}
+	}
+
+	free(chunks);
+	return ret;
 }
@@ -1,6 +1,19 @@
 #ifndef CRC32_H
 #define CRC32_H 1
 
-unsigned long crc32(unsigned char *buf, int len);
+#include <stddef.h>
+
+struct crc32_job {
+	const unsigned char *buf;
+	size_t len;
+	unsigned long crc;
+};
+
+unsigned long crc32(const unsigned char *buf, size_t len);
+unsigned long crc32_update(unsigned long crc, const unsigned char *buf, size_t len);
+unsigned long crc32_combine(unsigned long crc1, unsigned long crc2, size_t len2);
+unsigned long crc32_replace(unsigned long crc, unsigned long old_crc,
+			    unsigned long new_crc, size_t tail_len);
+int crc32_parallel(struct crc32_job *jobs, int njobs);
 
 #endif /* CRC32_H */
@@ -0,0 +1,306 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifdef _LINUX
+#define _GNU_SOURCE	/* copy_file_range() */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#ifdef _LINUX
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "fileio.h"
+
+/*
+ * Map a whole file into memory instead of copying it into a malloc'd
+ * buffer. Pages are only read in as they are touched.
+ *
+ * If writable is set, the mapping is private: the caller may modify the
+ * buffer, and only the pages it actually changes get copied. The file
+ * itself is never written.
+ */
+unsigned char *map_file(const char *fname, size_t *out_size, int writable)
+{
+	unsigned char *buf;
+	struct stat st;
+	int fd, prot;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		printf("Error opening file %s\n", fname);
+		return NULL;
+	}
+
+	if (fstat(fd, &st)) {
+		printf("Error: Could not stat %s\n", fname);
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size <= 0) {
+		printf("Bad file size of %s: %lld\n", fname, (long long) st.st_size);
+		close(fd);
+		return NULL;
+	}
+
+	prot = PROT_READ;
+	if (writable)
+		prot |= PROT_WRITE;
+
+	buf = mmap(NULL, st.st_size, prot, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (buf == MAP_FAILED) {
+		printf("Could not map %lld bytes of %s\n", (long long) st.st_size, fname);
+		return NULL;
+	}
+
+	/* Everything is read front to back at least once; start reading ahead */
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+	madvise(buf, st.st_size, MADV_WILLNEED);
+
+	*out_size = st.st_size;
+	return buf;
+}
+
+void unmap_file(unsigned char *buf, size_t size)
+{
+	if (buf)
+		munmap(buf, size);
+}
+
+/* Buffer size for the plain read/write fallback of copy_range() */
+#define COPY_BUF_SIZE	(1024 * 1024)
+
+/*
+ * Copy len bytes starting at in_offset in in_fd to the current position
+ * of out_fd. The position of in_fd is left alone.
+ *
+ * On Linux the data is moved by the kernel with copy_file_range(), which
+ * can share extents on btrfs/XFS, or sendfile() where that is not
+ * supported across the two files. Otherwise it goes through a large
+ * buffer with pread()/write(). Returns 0 on success, -1 on error or a
+ * short copy.
+ */
+int copy_range(int in_fd, off_t in_offset, int out_fd, size_t len)
+{
+	unsigned char *buf;
+	ssize_t ret;
+	size_t chunk;
+
+#ifdef _LINUX
+	while (len) {
+		ret = copy_file_range(in_fd, &in_offset, out_fd, NULL, len, 0);
+		if (ret <= 0)
+			break;
+		len -= ret;
+	}
+
+	while (len) {
+		ret = sendfile(out_fd, in_fd, &in_offset, len);
+		if (ret <= 0)
+			break;
+		len -= ret;
+	}
+#endif
+
+	if (!len)
+		return 0;
+
+	buf = malloc(COPY_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	while (len) {
+		chunk = len < COPY_BUF_SIZE ? len : COPY_BUF_SIZE;
+
+		ret = pread(in_fd, buf, chunk, in_offset);
+		if (ret <= 0)
+			break;
+
+		if (write(out_fd, buf, ret) != ret)
+			break;
+
+		in_offset += ret;
+		len -= ret;
+	}
+
+	free(buf);
+	return len ? -1 : 0;
+}
+
+/* pwrite() all of buf, retrying short writes. Returns 0 on success. */
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset)
+{
+	const unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = pwrite(fd, p, len, offset);
+		if (ret <= 0)
+			return -1;
+		p += ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Create dst as a copy of src and return it opened read/write, so that a
+ * patch tool only has to pwrite() the bytes it changed. Where the
+ * filesystem supports it (btrfs, XFS) the copy is a reflink sharing all
+ * of its extents with src, which costs next to no I/O or disk space;
+ * otherwise the data is copied with copy_range(). If dst already is src,
+ * it is opened as is. Otherwise dst is replaced by a new file (see
+ * create_file()) and *created is set, which is the only case in which
+ * the caller may remove it again on an error.
+ * Returns the fd, or -1 on error.
+ */
+int clone_file(const char *src, const char *dst, int *created)
+{
+	struct stat src_st, dst_st;
+	int in_fd, out_fd;
+
+	in_fd = open(src, O_RDONLY);
+	if (in_fd < 0) {
+		printf("Error opening file %s\n", src);
+		return -1;
+	}
+
+	if (fstat(in_fd, &src_st)) {
+		printf("Error: Could not stat %s\n", src);
+		close(in_fd);
+		return -1;
+	}
+
+	*created = 0;
+
+	/* Truncating a file we are patching in place would lose it */
+	if (stat(dst, &dst_st) == 0 &&
+	    dst_st.st_dev == src_st.st_dev && dst_st.st_ino == src_st.st_ino) {
+		close(in_fd);
+		out_fd = open(dst, O_RDWR);
+		if (out_fd < 0)
+			printf("Could not write to %s\n", dst);
+		return out_fd;
+	}
+
+	out_fd = create_file(dst);
+	if (out_fd < 0) {
+		printf("Could not write to %s\n", dst);
+		close(in_fd);
+		return -1;
+	}
+	*created = 1;
+
+#ifdef FICLONE
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		close(in_fd);
+		return out_fd;
+	}
+#endif
+
+	if (copy_range(in_fd, 0, out_fd, src_st.st_size)) {
+		printf("Error copying %s to %s\n", src, dst);
+		close(in_fd);
+		close(out_fd);
+		if (*created)
+			unlink(dst);
+		return -1;
+	}
+
+	close(in_fd);
+	return out_fd;
+}
+
+/*
+ * Create path as a new, empty file, removing whatever was there first.
+ * An existing file is never written through: after an extraction with
+ * --store it may be a hard link to an object in the store, shared with
+ * every other copy of the same data. Returns the fd, or -1 on error.
+ */
+int create_file(const char *path)
+{
+	unlink(path);
+	return open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+}
+
+/*
+ * Create a new, empty file next to dst to build its contents in, so that
+ * dst itself is only replaced, by rename(), once the output is complete.
+ * Until then dst is left alone, even if it is one of the inputs. The
+ * name is returned in tmp_path. Returns the fd, or -1 on error.
+ *
+ * mkstemp() always creates the file 0600. It is given the mode of the
+ * file it replaces, or the mode open() would have given a new one.
+ */
+int open_temp(const char *dst, char *tmp_path, size_t size)
+{
+	struct stat st;
+	mode_t mode;
+	int fd;
+
+	if ((size_t) snprintf(tmp_path, size, "%s.XXXXXX", dst) >= size) {
+		printf("Output file name too long: %s\n", dst);
+		return -1;
+	}
+
+	fd = mkstemp(tmp_path);
+	if (fd < 0) {
+		printf("Could not write to %s\n", tmp_path);
+		return -1;
+	}
+
+	if (stat(dst, &st) == 0) {
+		mode = st.st_mode & 07777;
+	} else {
+		mode = umask(0);
+		umask(mode);
+		mode = 0666 & ~mode;
+	}
+
+	fchmod(fd, mode);
+	return fd;
+}
+
+/*
+ * Tell the kernel the cached pages of fd will not be needed again, so
+ * that working through a large number of files does not push everything
+ * else out of the page cache.
+ */
+void drop_cache(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+	(void) fd;
+#endif
+}
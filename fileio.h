@@ -0,0 +1,16 @@
+#ifndef FILEIO_H
+#define FILEIO_H 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+unsigned char *map_file(const char *fname, size_t *out_size, int writable);
+void unmap_file(unsigned char *buf, size_t size);
+int copy_range(int in_fd, off_t in_offset, int out_fd, size_t len);
+int pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+int clone_file(const char *src, const char *dst, int *created);
+int create_file(const char *path);
+int open_temp(const char *dst, char *tmp_path, size_t size);
+void drop_cache(int fd);
+
+#endif /* FILEIO_H */
@@ -0,0 +1,251 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Read-only integrity check of firmware images.
+ *
+ * Both layouts are told apart by their global CRC alone. H4 images keep
+ * a little-endian CRC of [224, size) in their first word, H3+ images a
+ * big-endian CRC of [0, size - 4) in their last word. Each image is cut
+ * into [0, 224), [224, size - 4) and [size - 4, size), and both candidate
+ * CRCs are combined from those three, so the image is only read once.
+ * The pieces and all sections of all images are CRC'd together on every
+ * CPU.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "fwindex.h"
+#include "stats.h"
+
+#define GLOBAL_HEADER_SIZE	224
+
+/* Exit status; with several images, the highest one found */
+#define CHECK_OK		0
+#define CHECK_USAGE		1
+#define CHECK_IO		2	/* could not read the image */
+#define CHECK_FORMAT		3	/* too small, no sections, bad section length */
+#define CHECK_GLOBAL_CRC	4	/* neither an H4 nor an H3+ global CRC matches */
+#define CHECK_SECTION_CRC	5	/* a section does not match its header CRC */
+
+struct image {
+	const char *name;
+	unsigned char *buf;
+	size_t size;
+	struct section_info *sections;
+	int num_sections;
+	int first_job;			/* header, body, trailer, then the sections */
+	int status;
+	char error[128];		/* why the image could not be CRC'd at all */
+};
+
+static unsigned int read_word_le(const unsigned char *buf);
+static unsigned int read_word_le(const unsigned char *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int) buf[3] << 24);
+}
+
+static unsigned int read_word_be(const unsigned char *buf);
+static unsigned int read_word_be(const unsigned char *buf)
+{
+	return ((unsigned int) buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/* Problems found before the CRCs are run are reported with the results */
+static void fail(struct image *img, int status, const char *fmt, ...)
+	__attribute__ ((format (printf, 3, 4)));
+static void fail(struct image *img, int status, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(img->error, sizeof(img->error), fmt, ap);
+	va_end(ap);
+
+	img->status = status;
+}
+
+/* Find the section headers with the same scanner the other tools use */
+static int scan_image(struct image *img);
+static int scan_image(struct image *img)
+{
+	img->num_sections = index_scan_buf(img->buf, img->size, &img->sections);
+
+	if (img->num_sections == INDEX_SCAN_NOMEM) {
+		fail(img, CHECK_IO, "could not allocate the section table");
+		return -1;
+	}
+
+	if (img->num_sections == INDEX_SCAN_TRUNCATED) {
+		fail(img, CHECK_FORMAT, "a section runs past the end of the file");
+		return -1;
+	}
+
+	if (!img->num_sections) {
+		fail(img, CHECK_FORMAT, "no sections found");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void report(struct image *img, struct crc32_job *jobs);
+static void report(struct image *img, struct crc32_job *jobs)
+{
+	struct crc32_job *j = &jobs[img->first_job];
+	unsigned long h4_crc, h3plus_crc;
+	unsigned int h4_stored, h3plus_stored;
+	const char *layout = NULL;
+	int i;
+
+	h4_crc = crc32_combine(j[1].crc, j[2].crc, j[2].len);
+	h3plus_crc = crc32_combine(j[0].crc, j[1].crc, j[1].len);
+	h4_stored = read_word_le(img->buf);
+	h3plus_stored = read_word_be(img->buf + img->size - 4);
+
+	if (h4_crc == h4_stored)
+		layout = "H4";
+	else if (h3plus_crc == h3plus_stored)
+		layout = "H3+";
+	else {
+		printf("%s: global CRC mismatch: H4 header %08x, actual %08lx; "
+		       "H3+ trailer %08x, actual %08lx\n", img->name,
+		       h4_stored, h4_crc, h3plus_stored, h3plus_crc);
+		img->status = CHECK_GLOBAL_CRC;
+	}
+
+	for (i = 0; i < img->num_sections; i++) {
+		img->sections[i].actual_crc = j[3 + i].crc;
+		if (img->sections[i].actual_crc == img->sections[i].header_crc)
+			continue;
+
+		printf("%s: section %d at %08llx length %08zx: header CRC %08x, actual %08x\n",
+		       img->name, i, (long long) img->sections[i].offset, img->sections[i].length,
+		       img->sections[i].header_crc, img->sections[i].actual_crc);
+		img->status = CHECK_SECTION_CRC;
+	}
+
+	if (img->status == CHECK_OK)
+		printf("%s: OK (%s, %d sections)\n", img->name, layout, img->num_sections);
+	else
+		printf("%s: FAILED\n", img->name);
+}
+
+int main(int argc, char **argv)
+{
+	struct image *images;
+	struct crc32_job *jobs, *j;
+	unsigned long long total = 0;
+	int i, k, num_jobs = 0, failed = 0, ret = CHECK_OK;
+
+	stats_init(&argc, argv);
+
+	if (argc < 2) {
+		printf("Usage: %s [--stats] firmware.bin [firmware.bin...]\n", argv[0]);
+		printf("Checks the global CRC and every section CRC of H4 and H3+ images.\n");
+		printf("Exit status: 0 all OK, 2 unreadable, 3 not a firmware image,\n");
+		printf("4 global CRC mismatch, 5 section CRC mismatch (the highest one seen)\n");
+		return CHECK_USAGE;
+	}
+
+	images = calloc(argc - 1, sizeof(*images));
+	if (!images) {
+		printf("Could not allocate %d images\n", argc - 1);
+		return CHECK_IO;
+	}
+
+	stats_begin("scan");
+	for (i = 0; i < argc - 1; i++) {
+		images[i].name = argv[i + 1];
+		images[i].buf = map_file(argv[i + 1], &images[i].size, 0);
+		if (!images[i].buf) {
+			fail(&images[i], CHECK_IO, "could not read file");
+			continue;
+		}
+
+		if (images[i].size < GLOBAL_HEADER_SIZE + 4) {
+			fail(&images[i], CHECK_FORMAT, "too small for a firmware image (%zu bytes)",
+			     images[i].size);
+			continue;
+		}
+
+		if (scan_image(&images[i]))
+			continue;
+
+		images[i].first_job = num_jobs;
+		num_jobs += 3 + images[i].num_sections;
+		total += images[i].size;
+	}
+	stats_end("scan", total);
+
+	jobs = calloc(num_jobs ? num_jobs : 1, sizeof(*jobs));
+	if (!jobs) {
+		printf("Could not allocate %d CRC jobs\n", num_jobs);
+		return CHECK_IO;
+	}
+
+	for (i = 0; i < argc - 1; i++) {
+		if (images[i].status != CHECK_OK)
+			continue;
+
+		j = &jobs[images[i].first_job];
+		j[0].buf = images[i].buf;
+		j[0].len = GLOBAL_HEADER_SIZE;
+		j[1].buf = images[i].buf + GLOBAL_HEADER_SIZE;
+		j[1].len = images[i].size - GLOBAL_HEADER_SIZE - 4;
+		j[2].buf = images[i].buf + images[i].size - 4;
+		j[2].len = 4;
+
+		for (k = 0; k < images[i].num_sections; k++) {
+			j[3 + k].buf = images[i].buf + images[i].sections[k].offset;
+			j[3 + k].len = images[i].sections[k].length;
+		}
+	}
+
+	stats_begin("crc");
+	crc32_parallel(jobs, num_jobs);
+	stats_end("crc", total);
+
+	for (i = 0; i < argc - 1; i++) {
+		if (images[i].status == CHECK_OK)
+			report(&images[i], jobs);
+		else
+			printf("%s: %s: FAILED\n", images[i].name, images[i].error);
+
+		if (images[i].status != CHECK_OK)
+			failed++;
+		if (images[i].status > ret)
+			ret = images[i].status;
+
+		if (images[i].buf)
+			unmap_file(images[i].buf, images[i].size);
+		free(images[i].sections);
+	}
+
+	if (argc > 2)
+		printf("%d images checked, %d failed\n", argc - 1, failed);
+
+	free(jobs);
+	free(images);
+	return ret;
+}
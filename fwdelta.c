@@ -0,0 +1,706 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Delta packages between two firmware images.
+ *
+ * A delta is a list of operations that rebuild the new image front to
+ * back: COPY a range of the old image, or ADD literal bytes. The new
+ * image is cut along its section table; a section that also exists in
+ * the old image (same length and CRC) becomes a single COPY, and every
+ * other piece is encoded against its counterpart in the old image by
+ * greedily taking the longest match found in a suffix array of it.
+ *
+ * File format, all numbers little-endian:
+ *	"FWDELTA1", old size (8), old CRC (4), new size (8), new CRC (4)
+ *	then operations:
+ *	1, old offset (8), length (8)		COPY
+ *	2, length (8), length bytes		ADD
+ *	0					END
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "fwindex.h"
+
+#define DELTA_MAGIC	"FWDELTA1"
+#define DELTA_HDR_SIZE	32
+
+#define OP_END		0
+#define OP_COPY		1
+#define OP_ADD		2
+
+/* Shorter matches cost more as a COPY than as literal bytes */
+#define MIN_MATCH	24
+
+/* Suffix array searches start from the run of suffixes with the same first two bytes */
+#define BUCKETS		65536
+#define BUCKET_OF(p)	(((p)[0] << 8) | (p)[1])
+
+/*
+ * Bitmap of hashed 8-byte windows of the old data. A window whose bit is
+ * clear cannot start a match, so most literal bytes skip the search.
+ */
+#define FILTER_BITS	24
+#define FILTER_WINDOW	8
+
+#define APPLY_BUF_SIZE	(1024 * 1024)
+
+static void put_le(unsigned char *buf, uint64_t val, int bytes);
+static void put_le(unsigned char *buf, uint64_t val, int bytes)
+{
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		buf[i] = val >> (i * 8);
+}
+
+static uint64_t get_le(const unsigned char *buf, int bytes);
+static uint64_t get_le(const unsigned char *buf, int bytes)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = bytes - 1; i >= 0; i--)
+		val = (val << 8) | buf[i];
+
+	return val;
+}
+
+/*
+ * Operation writer. Adjacent COPYs of consecutive old data are merged,
+ * and literal bytes are collected until the next COPY.
+ */
+struct delta_out {
+	FILE *fd;
+	const unsigned char *lit;	/* pending literal bytes */
+	size_t lit_len;
+	uint64_t copy_off, copy_len;	/* pending COPY */
+	uint64_t copied, added;		/* totals */
+	int error;
+};
+
+static void flush_copy(struct delta_out *d);
+static void flush_copy(struct delta_out *d)
+{
+	unsigned char op[17];
+
+	if (!d->copy_len)
+		return;
+
+	op[0] = OP_COPY;
+	put_le(op + 1, d->copy_off, 8);
+	put_le(op + 9, d->copy_len, 8);
+	if (fwrite(op, sizeof(op), 1, d->fd) != 1)
+		d->error = 1;
+
+	d->copied += d->copy_len;
+	d->copy_len = 0;
+}
+
+static void flush_lit(struct delta_out *d);
+static void flush_lit(struct delta_out *d)
+{
+	unsigned char op[9];
+
+	if (!d->lit_len)
+		return;
+
+	op[0] = OP_ADD;
+	put_le(op + 1, d->lit_len, 8);
+	if (fwrite(op, sizeof(op), 1, d->fd) != 1 ||
+	    fwrite(d->lit, d->lit_len, 1, d->fd) != 1)
+		d->error = 1;
+
+	d->added += d->lit_len;
+	d->lit_len = 0;
+}
+
+static void emit_copy(struct delta_out *d, uint64_t off, uint64_t len);
+static void emit_copy(struct delta_out *d, uint64_t off, uint64_t len)
+{
+	flush_lit(d);
+
+	if (d->copy_len && d->copy_off + d->copy_len == off) {
+		d->copy_len += len;
+		return;
+	}
+
+	flush_copy(d);
+	d->copy_off = off;
+	d->copy_len = len;
+}
+
+/* buf must directly follow any literal bytes already pending */
+static void emit_lit(struct delta_out *d, const unsigned char *buf, size_t len);
+static void emit_lit(struct delta_out *d, const unsigned char *buf, size_t len)
+{
+	flush_copy(d);
+
+	if (!d->lit_len)
+		d->lit = buf;
+	d->lit_len += len;
+}
+
+/*
+ * Suffix array by prefix doubling. Suffixes are first radix sorted on
+ * their first three bytes (a missing byte sorts first). Each suffix is
+ * ranked by where its group of still-tied suffixes starts, and each round
+ * sorts only the tied groups, on the rank sa_k bytes further on, until
+ * no ties are left.
+ */
+static int *sa_rank;
+static int sa_n, sa_k;
+
+#define SA_DIGIT(buf, n, i, d)	((i) + (d) < (n) ? (buf)[(i) + (d)] + 1 : 0)
+
+static int sa_cmp(const void *a, const void *b);
+static int sa_cmp(const void *a, const void *b)
+{
+	int i = *(const int *) a, j = *(const int *) b;
+	int ri, rj;
+
+	ri = i + sa_k < sa_n ? sa_rank[i + sa_k] : 0;
+	rj = j + sa_k < sa_n ? sa_rank[j + sa_k] : 0;
+	return (ri > rj) - (ri < rj);
+}
+
+static int *build_suffix_array(const unsigned char *buf, int n);
+static int *build_suffix_array(const unsigned char *buf, int n)
+{
+	int *sa, *tmp, *from, *to, *swap;
+	int count[257];
+	int i, j, d, start, sorted;
+
+	sa = malloc((n ? n : 1) * sizeof(*sa));
+	sa_rank = malloc((n ? n : 1) * sizeof(*sa_rank));
+	tmp = malloc((n ? n : 1) * sizeof(*tmp));
+	if (!sa || !sa_rank || !tmp) {
+		free(sa);
+		free(sa_rank);
+		free(tmp);
+		return NULL;
+	}
+
+	/* Three counting sort passes, last byte first */
+	for (i = 0; i < n; i++)
+		tmp[i] = i;
+	from = tmp;
+	to = sa;
+	for (d = 2; d >= 0; d--) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[SA_DIGIT(buf, n, i, d)]++;
+		for (i = 0, start = 0; i < 257; i++) {
+			j = count[i];
+			count[i] = start;
+			start += j;
+		}
+		for (i = 0; i < n; i++)
+			to[count[SA_DIGIT(buf, n, from[i], d)]++] = from[i];
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != sa)
+		memcpy(sa, from, n * sizeof(*sa));
+
+	for (i = 0, start = 0; i < n; i++) {
+		if (i && (SA_DIGIT(buf, n, sa[i], 0) != SA_DIGIT(buf, n, sa[i - 1], 0) ||
+			  SA_DIGIT(buf, n, sa[i], 1) != SA_DIGIT(buf, n, sa[i - 1], 1) ||
+			  SA_DIGIT(buf, n, sa[i], 2) != SA_DIGIT(buf, n, sa[i - 1], 2)))
+			start = i;
+		sa_rank[sa[i]] = start + 1;
+	}
+
+	sa_n = n;
+	for (sa_k = 3, sorted = 0; !sorted; sa_k *= 2) {
+		memcpy(tmp, sa_rank, n * sizeof(*tmp));
+		sorted = 1;
+
+		for (start = 0; start < n; start = i) {
+			for (i = start + 1; i < n && sa_rank[sa[i]] == sa_rank[sa[start]]; i++)
+				;
+			if (i - start == 1)
+				continue;
+
+			sorted = 0;
+			qsort(sa + start, i - start, sizeof(*sa), sa_cmp);
+			for (j = start + 1; j < i; j++)
+				tmp[sa[j]] = sa_cmp(&sa[j - 1], &sa[j]) ? j + 1 : tmp[sa[j - 1]];
+		}
+
+		memcpy(sa_rank, tmp, n * sizeof(*tmp));
+	}
+
+	free(tmp);
+	free(sa_rank);
+	sa_rank = NULL;
+	return sa;
+}
+
+static size_t match_len(const unsigned char *a, size_t alen, const unsigned char *b, size_t blen);
+static size_t match_len(const unsigned char *a, size_t alen, const unsigned char *b, size_t blen)
+{
+	size_t i;
+
+	for (i = 0; i < alen && i < blen && a[i] == b[i]; i++)
+		;
+	return i;
+}
+
+static unsigned int window_hash(const unsigned char *buf);
+static unsigned int window_hash(const unsigned char *buf)
+{
+	uint64_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return (v * 0x9E3779B97F4A7C15ULL) >> (64 - FILTER_BITS);
+}
+
+/*
+ * Longest prefix of buf found in old, by binary search of the suffix
+ * array entries sa[lo, hi]
+ */
+static size_t longest_match(const int *sa, size_t lo, size_t hi, const unsigned char *old,
+			    size_t old_len, const unsigned char *buf, size_t len, size_t *pos);
+static size_t longest_match(const int *sa, size_t lo, size_t hi, const unsigned char *old,
+			    size_t old_len, const unsigned char *buf, size_t len, size_t *pos)
+{
+	size_t mid, a, b, n;
+
+	while (hi - lo >= 2) {
+		mid = lo + (hi - lo) / 2;
+		n = old_len - sa[mid] < len ? old_len - sa[mid] : len;
+		if (memcmp(old + sa[mid], buf, n) < 0)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	a = match_len(old + sa[lo], old_len - sa[lo], buf, len);
+	b = match_len(old + sa[hi], old_len - sa[hi], buf, len);
+	if (a >= b) {
+		*pos = sa[lo];
+		return a;
+	}
+
+	*pos = sa[hi];
+	return b;
+}
+
+/* Encode new[0, new_len) against old_base + [0, old_len) of the old image */
+static int encode_region(struct delta_out *d, const unsigned char *old, size_t old_base,
+			 size_t old_len, const unsigned char *buf, size_t len);
+static int encode_region(struct delta_out *d, const unsigned char *old, size_t old_base,
+			 size_t old_len, const unsigned char *buf, size_t len)
+{
+	const unsigned char *src = old + old_base;
+	size_t p = 0, n, pos, i;
+	int *sa = NULL, *bucket = NULL, k;
+	unsigned char *filter = NULL;
+	unsigned int h;
+
+	if (old_len > 0x7fffffff) {
+		printf("Sections over 2 GB are not supported\n");
+		return -1;
+	}
+
+	if (old_len >= MIN_MATCH) {
+		sa = build_suffix_array(src, old_len);
+		bucket = malloc(BUCKETS * 2 * sizeof(*bucket));
+		filter = calloc(1, 1 << (FILTER_BITS - 3));
+		if (!sa || !bucket || !filter) {
+			printf("Could not allocate suffix array for %zu bytes\n", old_len);
+			free(sa);
+			free(bucket);
+			free(filter);
+			return -1;
+		}
+
+		for (i = 0; i + FILTER_WINDOW <= old_len; i++) {
+			h = window_hash(src + i);
+			filter[h >> 3] |= 1 << (h & 7);
+		}
+
+		/*
+		 * Suffixes sharing their first two bytes are adjacent in the
+		 * array; note where each such run starts and ends, so a search
+		 * only has to bisect one run.
+		 */
+		memset(bucket, 0xff, BUCKETS * 2 * sizeof(*bucket));
+		for (i = 0; i < old_len; i++) {
+			if ((size_t) sa[i] == old_len - 1)
+				continue;
+			k = BUCKET_OF(src + sa[i]);
+			if (bucket[k * 2] < 0)
+				bucket[k * 2] = i;
+			bucket[k * 2 + 1] = i;
+		}
+	}
+
+	while (p < len) {
+		n = 0;
+		if (sa && len - p >= MIN_MATCH) {
+			h = window_hash(buf + p);
+			k = filter[h >> 3] & (1 << (h & 7)) ? BUCKET_OF(buf + p) : -1;
+			if (k >= 0 && bucket[k * 2] >= 0)
+				n = longest_match(sa, bucket[k * 2], bucket[k * 2 + 1],
+						  src, old_len, buf + p, len - p, &pos);
+		}
+		if (n >= MIN_MATCH) {
+			emit_copy(d, old_base + pos, n);
+			p += n;
+		} else {
+			emit_lit(d, buf + p, 1);
+			p++;
+		}
+	}
+
+	free(filter);
+	free(bucket);
+	free(sa);
+	return 0;
+}
+
+static int scan_sections(const char *fname, struct section_info **out);
+static int scan_sections(const char *fname, struct section_info **out)
+{
+	FILE *fd;
+	int num;
+
+	num = index_load(fname, 0, out);
+	if (num >= 0)
+		return num;
+
+	fd = fopen(fname, "rb");
+	if (!fd) {
+		printf("Could not open %s\n", fname);
+		return -1;
+	}
+
+	num = index_scan(fd, out);
+	fclose(fd);
+
+	if (num < 0)
+		printf("Could not scan %s\n", fname);
+	else
+		index_save(fname, 0, *out, num);
+
+	return num;
+}
+
+static int make_delta(const char *old_name, const char *new_name, const char *delta_name);
+static int make_delta(const char *old_name, const char *new_name, const char *delta_name)
+{
+	struct section_info *old_sec = NULL, *new_sec = NULL, *s, *o;
+	unsigned char *old = NULL, *buf = NULL, hdr[DELTA_HDR_SIZE], end = OP_END;
+	size_t old_size, size, pos, gap_start, gap_end, old_gap_start, old_gap_end;
+	uint64_t copied, added;
+	struct delta_out d;
+	char tmp_path[PATH_MAX + 8];
+	int old_num, num, fd, i, j, ret = -1;
+
+	memset(&d, 0, sizeof(d));
+
+	old = map_file(old_name, &old_size, 0);
+	buf = map_file(new_name, &size, 0);
+	if (!old || !buf)
+		goto out;
+
+	old_num = scan_sections(old_name, &old_sec);
+	num = scan_sections(new_name, &new_sec);
+	if (old_num < 0 || num < 0)
+		goto out;
+
+	for (i = 0; i < old_num; i++)
+		if ((size_t) old_sec[i].offset + old_sec[i].length > old_size)
+			old_num = i;
+	for (i = 0; i < num; i++)
+		if ((size_t) new_sec[i].offset + new_sec[i].length > size)
+			num = i;
+
+	/* The delta replaces delta_name only once it is complete */
+	fd = open_temp(delta_name, tmp_path, sizeof(tmp_path));
+	if (fd < 0)
+		goto out;
+
+	d.fd = fdopen(fd, "wb");
+	if (!d.fd) {
+		printf("Could not write to %s\n", delta_name);
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	memcpy(hdr, DELTA_MAGIC, 8);
+	put_le(hdr + 8, old_size, 8);
+	put_le(hdr + 16, crc32_update(0L, old, old_size), 4);
+	put_le(hdr + 20, size, 8);
+	put_le(hdr + 28, crc32_update(0L, buf, size), 4);
+	fwrite(hdr, sizeof(hdr), 1, d.fd);
+
+	printf("Old image: %zu bytes, %d sections\n", old_size, old_num);
+	printf("New image: %zu bytes, %d sections\n\n", size, num);
+
+	/*
+	 * Walk the new image as alternating gaps (global and section headers,
+	 * padding) and sections. Each gap is encoded against the old gap with
+	 * the same index, each section against an identical old section if
+	 * there is one, or else the old section with the same index.
+	 */
+	pos = 0;
+	for (i = 0; i <= num; i++) {
+		gap_start = pos;
+		gap_end = i < num ? (size_t) new_sec[i].offset : size;
+		old_gap_start = i && i - 1 < old_num ? old_sec[i - 1].offset + old_sec[i - 1].length : 0;
+		old_gap_end = i < old_num ? (size_t) old_sec[i].offset : old_size;
+		if (old_gap_end < old_gap_start)
+			old_gap_end = old_gap_start;
+
+		if (encode_region(&d, old, old_gap_start, old_gap_end - old_gap_start,
+				  buf + gap_start, gap_end - gap_start))
+			goto out;
+
+		if (i == num)
+			break;
+
+		s = &new_sec[i];
+		pos = s->offset + s->length;
+
+		for (j = 0, o = NULL; j < old_num && !o; j++)
+			if (old_sec[j].length == s->length && old_sec[j].header_crc == s->header_crc &&
+			    memcmp(old + old_sec[j].offset, buf + s->offset, s->length) == 0)
+				o = &old_sec[j];
+
+		if (o) {
+			printf("section_%d: same as old section_%d\n", i, (int) (o - old_sec));
+			emit_copy(&d, o->offset, s->length);
+			continue;
+		}
+
+		copied = d.copied + d.copy_len;
+		added = d.added + d.lit_len;
+
+		o = i < old_num ? &old_sec[i] : NULL;
+		if (encode_region(&d, old, o ? o->offset : 0, o ? o->length : 0,
+				  buf + s->offset, s->length))
+			goto out;
+
+		printf("section_%d: changed, %llu bytes copied, %llu bytes new\n", i,
+		       (unsigned long long) (d.copied + d.copy_len - copied),
+		       (unsigned long long) (d.added + d.lit_len - added));
+	}
+
+	flush_copy(&d);
+	flush_lit(&d);
+	fwrite(&end, 1, 1, d.fd);
+
+	if (d.error || ferror(d.fd)) {
+		printf("Error writing %s\n", delta_name);
+		goto out;
+	}
+
+	printf("\n%llu bytes copied from the old image, %llu bytes new\n",
+	       (unsigned long long) d.copied, (unsigned long long) d.added);
+	printf("Delta size: %lld bytes (%.1f%% of the new image)\n", (long long) ftello(d.fd),
+	       size ? 100.0 * ftello(d.fd) / size : 0);
+	ret = 0;
+
+out:
+	if (d.fd && fclose(d.fd))
+		ret = -1;
+	if (!ret && rename(tmp_path, delta_name)) {
+		printf("Could not write to %s\n", delta_name);
+		ret = -1;
+	}
+	if (ret && d.fd)
+		unlink(tmp_path);
+	free(new_sec);
+	free(old_sec);
+	unmap_file(buf, size);
+	unmap_file(old, old_size);
+	return ret;
+}
+
+/* CRC a whole file without holding it in memory */
+static int crc_file(int fd, uint64_t size, unsigned long *crc, unsigned char *buf);
+static int crc_file(int fd, uint64_t size, unsigned long *crc, unsigned char *buf)
+{
+	uint64_t pos;
+	ssize_t n;
+
+	*crc = 0;
+	for (pos = 0; pos < size; pos += n) {
+		n = pread(fd, buf, size - pos < APPLY_BUF_SIZE ? size - pos : APPLY_BUF_SIZE, pos);
+		if (n <= 0)
+			return -1;
+		*crc = crc32_update(*crc, buf, n);
+	}
+
+	return 0;
+}
+
+/*
+ * Rebuild the new image from the old one and a delta, streaming through
+ * a fixed size buffer and CRC'ing the output as it is written. A partial
+ * or mismatching output is removed.
+ */
+static int apply_delta(const char *old_name, const char *delta_name, const char *new_name);
+static int apply_delta(const char *old_name, const char *delta_name, const char *new_name)
+{
+	unsigned char hdr[DELTA_HDR_SIZE], op[17], *buf = NULL;
+	uint64_t old_size, size, off, len, pos = 0;
+	unsigned long old_crc, crc = 0;
+	char tmp_path[PATH_MAX + 8];
+	struct stat st;
+	FILE *delta;
+	int old_fd = -1, out_fd = -1, created = 0, ret = -1;
+	size_t n;
+
+	delta = fopen(delta_name, "rb");
+	if (!delta) {
+		printf("Could not open %s\n", delta_name);
+		return -1;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, delta) != 1 || memcmp(hdr, DELTA_MAGIC, 8)) {
+		printf("%s is not a firmware delta\n", delta_name);
+		goto out;
+	}
+	old_size = get_le(hdr + 8, 8);
+	size = get_le(hdr + 20, 8);
+
+	buf = malloc(APPLY_BUF_SIZE);
+	old_fd = open(old_name, O_RDONLY);
+	if (!buf || old_fd < 0 || fstat(old_fd, &st)) {
+		printf("Could not read %s\n", old_name);
+		goto out;
+	}
+
+	printf("Checking %s...\n", old_name);
+	if ((uint64_t) st.st_size != old_size || crc_file(old_fd, old_size, &old_crc, buf) ||
+	    old_crc != get_le(hdr + 16, 4)) {
+		printf("%s is not the image this delta was made from\n", old_name);
+		goto out;
+	}
+
+	/* new_name may be old_name; it is only replaced once the result checks out */
+	out_fd = open_temp(new_name, tmp_path, sizeof(tmp_path));
+	if (out_fd < 0)
+		goto out;
+	created = 1;
+
+	printf("Writing %s...\n", new_name);
+	while (fread(op, 1, 1, delta) == 1 && op[0] != OP_END) {
+		if (op[0] == OP_COPY) {
+			if (fread(op + 1, 16, 1, delta) != 1)
+				break;
+			off = get_le(op + 1, 8);
+			len = get_le(op + 9, 8);
+			if (off > old_size || len > old_size - off)
+				break;
+		} else if (op[0] == OP_ADD) {
+			if (fread(op + 1, 8, 1, delta) != 1)
+				break;
+			off = 0;
+			len = get_le(op + 1, 8);
+		} else {
+			break;
+		}
+
+		if (len > size - pos)
+			break;
+
+		for (; len; len -= n, off += n, pos += n) {
+			n = len < APPLY_BUF_SIZE ? len : APPLY_BUF_SIZE;
+			if (op[0] == OP_COPY ? pread(old_fd, buf, n, off) != (ssize_t) n :
+					       fread(buf, n, 1, delta) != 1)
+				goto corrupt;
+			crc = crc32_update(crc, buf, n);
+			if (pwrite_all(out_fd, buf, n, pos)) {
+				printf("Error writing %s\n", new_name);
+				goto out;
+			}
+		}
+	}
+
+	if (op[0] != OP_END || pos != size) {
+corrupt:
+		printf("%s is corrupt\n", delta_name);
+		goto out;
+	}
+
+	printf("New image CRC: %08lx (%s)\n", crc, crc == get_le(hdr + 28, 4) ? "OK" : "MISMATCH!");
+	if (crc != get_le(hdr + 28, 4))
+		goto out;
+
+	ret = close(out_fd);
+	out_fd = -1;
+	if (ret || rename(tmp_path, new_name)) {
+		printf("Error writing %s\n", new_name);
+		ret = -1;
+	} else {
+		printf("Done.\n");
+	}
+
+out:
+	if (out_fd >= 0)
+		close(out_fd);
+	if (ret && created)
+		unlink(tmp_path);
+	if (old_fd >= 0)
+		close(old_fd);
+	free(buf);
+	fclose(delta);
+	return ret;
+}
+
+static void print_usage(const char *name);
+static void print_usage(const char *name)
+{
+	printf("Usage: %s make old_firmware.bin new_firmware.bin update.delta\n", name);
+	printf("       %s apply old_firmware.bin update.delta new_firmware.bin\n\n", name);
+	printf("make   - encode new_firmware.bin as the changes from old_firmware.bin\n");
+	printf("apply  - rebuild new_firmware.bin from old_firmware.bin and the delta, checking\n");
+	printf("         that the result is exactly the image the delta was made from\n");
+}
+
+int main(int argc, char **argv)
+{
+	index_options(&argc, argv);
+
+	if (argc == 5 && strcmp(argv[1], "make") == 0)
+		return make_delta(argv[2], argv[3], argv[4]);
+
+	if (argc == 5 && strcmp(argv[1], "apply") == 0)
+		return apply_delta(argv[2], argv[3], argv[4]);
+
+	print_usage(argv[0]);
+	return -1;
+}
@@ -0,0 +1,366 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Generator for synthetic firmware images and romfs sections, so the
+ * other tools can be tested and benchmarked without real camera firmware.
+ * The contents are pseudo-random but reproducible, and every CRC in the
+ * generated images is valid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <inttypes.h>
+
+#include "crc32.h"
+
+#define GLOBAL_HEADER_SIZE	224
+#define SECTION_HEADER_SIZE	0x100
+#define SECTION_MAGIC		0xA324EB90
+
+#define INODE_MAGIC		0x2387AB76
+#define INODE_TABLE_OFFSET	0x800
+#define INODE_SIZE		128
+#define INODE_NAME_LEN		0x73
+#define ROMFS_DATA_ALIGN	0x800
+
+#define GEN_BUF_SIZE		(1024 * 1024)
+#define DEFAULT_SECTIONS	8
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void);
+static uint64_t rng_next(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/*
+ * Fill buf with pseudo-random data. The top bit of every byte is cleared
+ * so that the data can never contain the section magic (90 EB 24 A3) and
+ * confuse the section scanners.
+ */
+static void fill_random(unsigned char *buf, size_t len);
+static void fill_random(unsigned char *buf, size_t len)
+{
+	uint64_t r;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		r = rng_next() & 0x7f7f7f7f7f7f7f7fULL;
+		memcpy(buf + i, &r, 8);
+	}
+
+	for (; i < len; i++)
+		buf[i] = rng_next() & 0x7f;
+}
+
+static void write_word_le(unsigned char *buf, int offset, uint32_t word);
+static void write_word_le(unsigned char *buf, int offset, uint32_t word)
+{
+	buf[offset+0] = word >> 0;
+	buf[offset+1] = word >> 8;
+	buf[offset+2] = word >> 16;
+	buf[offset+3] = word >> 24;
+}
+
+static void write_word_be(unsigned char *buf, int offset, uint32_t word);
+static void write_word_be(unsigned char *buf, int offset, uint32_t word)
+{
+	buf[offset+0] = word >> 24;
+	buf[offset+1] = word >> 16;
+	buf[offset+2] = word >> 8;
+	buf[offset+3] = word >> 0;
+}
+
+static int write_at(FILE *fd, off_t offset, const unsigned char *buf, size_t len);
+static int write_at(FILE *fd, off_t offset, const unsigned char *buf, size_t len)
+{
+	if (fseeko(fd, offset, SEEK_SET))
+		return -1;
+
+	return fwrite(buf, len, 1, fd) == 1 ? 0 : -1;
+}
+
+/*
+ * Write a firmware image of about size bytes holding num_sections
+ * sections of random data. The section CRCs are only known once their
+ * data has been written, so the header fields are written as zeros and
+ * filled in at the end, correcting the global CRC with crc32_replace().
+ * With trailer set, the global CRC is stored big-endian in the last word
+ * (H3+); otherwise little-endian at the start of a 224 byte header (H4).
+ */
+static int gen_firmware(const char *output_name, off_t size, int num_sections, int trailer);
+static int gen_firmware(const char *output_name, off_t size, int num_sections, int trailer)
+{
+	static const unsigned char zeros[4];
+	unsigned char *buf, hdr[SECTION_HEADER_SIZE], field[4];
+	unsigned long *section_crcs, global_crc = 0;
+	off_t *field_offsets;
+	off_t body, pos, global_start, global_end;
+	size_t n, length, left;
+	FILE *fd;
+	int i, ret = -1;
+
+	global_start = trailer ? 0 : GLOBAL_HEADER_SIZE;
+	body = size - (trailer ? 4 : GLOBAL_HEADER_SIZE) - (off_t) num_sections * SECTION_HEADER_SIZE;
+
+	if (num_sections <= 0 || body < num_sections) {
+		printf("%lld bytes is too small for %d sections\n", (long long) size, num_sections);
+		return -1;
+	}
+
+	if (body / num_sections + body % num_sections > INT_MAX) {
+		printf("Sections would be longer than %d bytes; use more sections\n", INT_MAX);
+		return -1;
+	}
+
+	buf = malloc(GEN_BUF_SIZE);
+	section_crcs = calloc(num_sections, sizeof(*section_crcs));
+	field_offsets = calloc(num_sections, sizeof(*field_offsets));
+	if (!buf || !section_crcs || !field_offsets) {
+		printf("Could not allocate buffers\n");
+		goto out_free;
+	}
+
+	fd = fopen(output_name, "wb");
+	if (!fd) {
+		printf("Could not write to %s\n", output_name);
+		goto out_free;
+	}
+
+	if (!trailer) {
+		memset(hdr, 0, GLOBAL_HEADER_SIZE);
+		fwrite(hdr, GLOBAL_HEADER_SIZE, 1, fd);
+	}
+	pos = global_start;
+
+	for (i = 0; i < num_sections; i++) {
+		length = body / num_sections;
+		if (i == num_sections - 1)
+			length += body % num_sections;
+
+		memset(hdr, 0, sizeof(hdr));
+		write_word_le(hdr, 4, 0x100 + i);	/* version */
+		write_word_le(hdr, 8, 0x20150101);	/* build date */
+		write_word_le(hdr, 12, length);
+		write_word_le(hdr, 20, 1);		/* flags */
+		write_word_le(hdr, 24, SECTION_MAGIC);
+
+		field_offsets[i] = pos;
+		global_crc = crc32_update(global_crc, hdr, sizeof(hdr));
+		if (fwrite(hdr, sizeof(hdr), 1, fd) != 1)
+			goto out_close;
+		pos += sizeof(hdr);
+
+		for (left = length; left; left -= n) {
+			n = left < GEN_BUF_SIZE ? left : GEN_BUF_SIZE;
+			fill_random(buf, n);
+			section_crcs[i] = crc32_update(section_crcs[i], buf, n);
+			global_crc = crc32_update(global_crc, buf, n);
+			if (fwrite(buf, n, 1, fd) != 1)
+				goto out_close;
+		}
+		pos += length;
+	}
+
+	global_end = pos;
+
+	for (i = 0; i < num_sections; i++) {
+		write_word_le(field, 0, section_crcs[i]);
+		if (write_at(fd, field_offsets[i], field, 4))
+			goto out_close;
+		global_crc = crc32_replace(global_crc, crc32((unsigned char *) zeros, 4),
+					   crc32(field, 4), global_end - (field_offsets[i] + 4));
+	}
+
+	if (trailer) {
+		write_word_be(field, 0, global_crc);
+		if (write_at(fd, global_end, field, 4))
+			goto out_close;
+	} else {
+		write_word_le(field, 0, global_crc);
+		if (write_at(fd, 0, field, 4))
+			goto out_close;
+	}
+
+	ret = 0;
+out_close:
+	if (ferror(fd) | fclose(fd))
+		ret = -1;
+	if (ret)
+		printf("Error writing %s\n", output_name);
+	else
+		printf("Wrote %d sections to %s (global CRC %08lx)\n", num_sections, output_name, global_crc);
+out_free:
+	free(field_offsets);
+	free(section_crcs);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Write a romfs section of about size bytes holding num_files files of
+ * random length in a small directory tree, laid out the same way as
+ * goprom --build does.
+ */
+static int gen_romfs(const char *output_name, off_t size, int num_files);
+static int gen_romfs(const char *output_name, off_t size, int num_files)
+{
+	unsigned char *buf, inode[INODE_SIZE];
+	size_t *lengths, n, left;
+	off_t data_start, avg, pos, offset;
+	FILE *fd;
+	int i, ret = -1;
+
+	data_start = INODE_TABLE_OFFSET + (off_t) num_files * INODE_SIZE;
+	if (num_files <= 0 || size < data_start) {
+		printf("%lld bytes is too small for %d files\n", (long long) size, num_files);
+		return -1;
+	}
+
+	if (size > INT_MAX) {
+		printf("romfs offsets are limited to %d bytes\n", INT_MAX);
+		return -1;
+	}
+
+	buf = malloc(GEN_BUF_SIZE);
+	lengths = calloc(num_files, sizeof(*lengths));
+	if (!buf || !lengths) {
+		printf("Could not allocate buffers\n");
+		goto out_free;
+	}
+
+	/* Uniform lengths in [0, 2 * avg), so the total comes out near size */
+	avg = (size - data_start) / num_files;
+	for (i = 0; i < num_files; i++)
+		lengths[i] = avg ? rng_next() % (2 * avg) : 0;
+
+	fd = fopen(output_name, "wb");
+	if (!fd) {
+		printf("Could not write to %s\n", output_name);
+		goto out_free;
+	}
+
+	memset(buf, 0, INODE_TABLE_OFFSET);
+	write_word_le(buf, 0, num_files);
+	fwrite(buf, INODE_TABLE_OFFSET, 1, fd);
+
+	pos = data_start;
+	for (i = 0; i < num_files; i++) {
+		if (lengths[i])
+			pos = (pos + ROMFS_DATA_ALIGN - 1) & ~(off_t) (ROMFS_DATA_ALIGN - 1);
+		if (pos + (off_t) lengths[i] > INT_MAX) {
+			printf("romfs offsets are limited to %d bytes\n", INT_MAX);
+			goto out_close;
+		}
+
+		memset(inode, 0, sizeof(inode));
+		snprintf((char *) inode, INODE_NAME_LEN, "dir%d/sub%d/file%d.bin", i % 7, i % 3, i);
+		write_word_le(inode, 0x74, pos);
+		write_word_le(inode, 0x78, lengths[i]);
+		write_word_le(inode, 0x7c, INODE_MAGIC);
+		fwrite(inode, sizeof(inode), 1, fd);
+		pos += lengths[i];
+	}
+
+	pos = data_start;
+	for (i = 0; i < num_files; i++) {
+		if (!lengths[i])
+			continue;
+
+		offset = (pos + ROMFS_DATA_ALIGN - 1) & ~(off_t) (ROMFS_DATA_ALIGN - 1);
+		memset(buf, 0, offset - pos);
+		fwrite(buf, offset - pos, 1, fd);
+		pos = offset;
+
+		for (left = lengths[i]; left; left -= n) {
+			n = left < GEN_BUF_SIZE ? left : GEN_BUF_SIZE;
+			fill_random(buf, n);
+			if (fwrite(buf, n, 1, fd) != 1)
+				goto out_close;
+		}
+		pos += lengths[i];
+	}
+
+	ret = 0;
+out_close:
+	if (ferror(fd) | fclose(fd))
+		ret = -1;
+	if (ret)
+		printf("Error writing %s\n", output_name);
+	else
+		printf("Wrote %d files (%lld bytes) to %s\n", num_files, (long long) pos, output_name);
+out_free:
+	free(lengths);
+	free(buf);
+	return ret;
+}
+
+static void print_usage(const char *name);
+static void print_usage(const char *name)
+{
+	printf("Usage: %s h4 output.bin size_mb [num_sections]\n", name);
+	printf("       %s h3plus output.bin size_mb [num_sections]\n", name);
+	printf("       %s romfs output.bin size_mb [num_files]\n\n", name);
+	printf("Generates a synthetic image of roughly size_mb megabytes with valid CRCs,\n");
+	printf("for testing and benchmarking the other tools. The same arguments always\n");
+	printf("produce the same image. Firmware images default to %d sections, romfs\n", DEFAULT_SECTIONS);
+	printf("sections to one file per 64 KB.\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *type, *output_name;
+	off_t size;
+	int count = 0;
+
+	if (argc != 4 && argc != 5) {
+		print_usage(argv[0]);
+		return -1;
+	}
+
+	type = argv[1];
+	output_name = argv[2];
+	size = (off_t) strtoll(argv[3], NULL, 0) * 1024 * 1024;
+	if (argc == 5)
+		count = atoi(argv[4]);
+
+	if (size <= 0) {
+		printf("Bad image size: %s\n", argv[3]);
+		return -1;
+	}
+
+	if (strcmp(type, "h4") == 0)
+		return gen_firmware(output_name, size, count ? count : DEFAULT_SECTIONS, 0);
+
+	if (strcmp(type, "h3plus") == 0)
+		return gen_firmware(output_name, size, count ? count : DEFAULT_SECTIONS, 1);
+
+	if (strcmp(type, "romfs") == 0)
+		return gen_romfs(output_name, size, count ? count : (int) (size / (64 * 1024)) + 1);
+
+	print_usage(argv[0]);
+	return -1;
+}
@@ -0,0 +1,392 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Section index cache.
+ *
+ * Scanning a firmware image for section headers (and verifying their
+ * CRCs) is by far the most expensive thing the tools do, and the same
+ * image tends to go through several of them in a row. The resulting
+ * section table is therefore cached on disk, in
+ *
+ *	$FWINDEX_DIR, or $XDG_CACHE_HOME/gopro-fw-tools, or
+ *	$HOME/.cache/gopro-fw-tools
+ *
+ * in a file named after the device and inode of the image. An index is
+ * only used if the size, mtime, inode and a CRC of the first and last
+ * 64 KB of the image all still match. --revalidate ignores any existing
+ * index and writes a fresh one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "crc32.h"
+#include "fwindex.h"
+#include "magic.h"
+
+#define INDEX_MAGIC		"FWIDX002"
+#define FINGERPRINT_SIZE	(64 * 1024)
+#define SECTION_HEADER_SIZE	0x100
+
+#ifdef _MACOSX
+#define ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#endif
+
+struct index_header {
+	char magic[8];
+	uint64_t size;
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+	uint64_t dev;
+	uint64_t ino;
+	uint32_t fingerprint;
+	uint32_t flags;
+	uint32_t num_sections;
+	uint32_t reserved;
+};
+
+static int index_revalidate;
+
+/* Strip the index options out of argv */
+void index_options(int *argc, char **argv)
+{
+	int i, j;
+
+	for (i = 1, j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--revalidate") == 0)
+			index_revalidate = 1;
+		else
+			argv[j++] = argv[i];
+	}
+	*argc = j;
+	argv[j] = NULL;
+}
+
+static unsigned int read_word(const unsigned char *buf);
+static unsigned int read_word(const unsigned char *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((unsigned int) buf[3] << 24);
+}
+
+/*
+ * Walk every section header in an image held in memory and return a
+ * malloc'd table of them in *out. No CRCs are checked; actual_crc is set
+ * to header_crc. This is the only section header parser; every tool
+ * that needs the table goes through it, so they all agree on what is a
+ * section. A magic too close to the start of the image to have a header
+ * in front of it is not one. Lengths are unsigned 32-bit and every one
+ * is checked against the size of the image. Returns the number of
+ * sections, INDEX_SCAN_NOMEM or INDEX_SCAN_TRUNCATED.
+ *
+ * Thanks to this guy for info on the header format:
+ * https://gist.github.com/2394361
+ */
+int index_scan_buf(const unsigned char *buf, size_t size, struct section_info **out)
+{
+	struct section_info *sections = NULL, *tmp, s;
+	int num = 0, max = 0;
+	size_t offset = 0, start;
+	off_t hit;
+
+	*out = NULL;
+
+	while ((hit = find_magic(buf, size, offset)) >= 0) {
+		offset = hit;
+		if (offset < 28)
+			continue;
+
+		start = offset - 28;
+		if (size - start < SECTION_HEADER_SIZE) {
+			free(sections);
+			return INDEX_SCAN_TRUNCATED;
+		}
+
+		s.header_crc = read_word(buf + start);
+		s.version = read_word(buf + start + 4);
+		s.build_date = read_word(buf + start + 8);
+		s.length = read_word(buf + start + 12);
+		s.flags = read_word(buf + start + 20);
+		s.magic = read_word(buf + start + 24);
+		s.offset = start + SECTION_HEADER_SIZE;
+		s.actual_crc = s.header_crc;
+
+		if (s.length > size - (size_t) s.offset) {
+			free(sections);
+			return INDEX_SCAN_TRUNCATED;
+		}
+
+		if (num >= max) {
+			max = max ? max * 2 : 64;
+			tmp = realloc(sections, max * sizeof(*sections));
+			if (!tmp) {
+				free(sections);
+				return INDEX_SCAN_NOMEM;
+			}
+			sections = tmp;
+		}
+		sections[num++] = s;
+
+		offset = s.offset + s.length;
+	}
+
+	if (!sections)
+		sections = malloc(sizeof(*sections));
+	if (!sections)
+		return INDEX_SCAN_NOMEM;
+
+	*out = sections;
+	return num;
+}
+
+/*
+ * index_scan_buf() on an open file. The file is mapped rather than read,
+ * so only the pages holding section headers are ever touched.
+ */
+int index_scan(FILE *fd, struct section_info **out)
+{
+	unsigned char *buf;
+	struct stat st;
+	int num;
+
+	if (fstat(fileno(fd), &st))
+		return -1;
+
+	if (st.st_size == 0)
+		return index_scan_buf(NULL, 0, out);
+
+	if ((unsigned long long) st.st_size > (size_t) -1)
+		return -1;
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fd), 0);
+	if (buf == MAP_FAILED)
+		return -1;
+
+	num = index_scan_buf(buf, st.st_size, out);
+	munmap(buf, st.st_size);
+	return num;
+}
+
+/* Work out the cache file name for an image; returns -1 if there is no cache */
+static int index_path(const struct stat *st, char *path, size_t size);
+static int index_path(const struct stat *st, char *path, size_t size)
+{
+	char dir[PATH_MAX];
+	const char *env;
+
+	if ((env = getenv("FWINDEX_DIR")) != NULL && *env) {
+		snprintf(dir, sizeof(dir), "%s", env);
+	} else if ((env = getenv("XDG_CACHE_HOME")) != NULL && *env) {
+		snprintf(dir, sizeof(dir), "%s/gopro-fw-tools", env);
+		mkdir(env, 0700);
+	} else if ((env = getenv("HOME")) != NULL && *env) {
+		snprintf(dir, sizeof(dir), "%s/.cache", env);
+		mkdir(dir, 0700);
+		snprintf(dir, sizeof(dir), "%s/.cache/gopro-fw-tools", env);
+	} else {
+		return -1;
+	}
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+
+	if ((size_t) snprintf(path, size, "%s/%llx-%llx.idx", dir,
+			      (unsigned long long) st->st_dev,
+			      (unsigned long long) st->st_ino) >= size)
+		return -1;
+
+	return 0;
+}
+
+/* Fill in the identity of the image: stat data plus a CRC of its ends */
+static int index_identify(const char *fname, struct index_header *hdr, char *path, size_t size);
+static int index_identify(const char *fname, struct index_header *hdr, char *path, size_t size)
+{
+	unsigned char *buf;
+	struct stat st;
+	unsigned long crc;
+	ssize_t n;
+	int fd;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) || index_path(&st, path, size)) {
+		close(fd);
+		return -1;
+	}
+
+	buf = malloc(FINGERPRINT_SIZE);
+	if (!buf) {
+		close(fd);
+		return -1;
+	}
+
+	n = pread(fd, buf, FINGERPRINT_SIZE, 0);
+	crc = crc32_update(0L, buf, n > 0 ? n : 0);
+	if (st.st_size > FINGERPRINT_SIZE) {
+		n = pread(fd, buf, FINGERPRINT_SIZE, st.st_size - FINGERPRINT_SIZE);
+		crc = crc32_update(crc, buf, n > 0 ? n : 0);
+	}
+
+	free(buf);
+	close(fd);
+
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+	hdr->size = st.st_size;
+	hdr->mtime_sec = st.st_mtime;
+	hdr->mtime_nsec = ST_MTIME_NSEC(&st);
+	hdr->dev = st.st_dev;
+	hdr->ino = st.st_ino;
+	hdr->fingerprint = crc;
+	return 0;
+}
+
+static int index_matches(const struct index_header *a, const struct index_header *b);
+static int index_matches(const struct index_header *a, const struct index_header *b)
+{
+	return memcmp(a->magic, b->magic, sizeof(a->magic)) == 0 &&
+	       a->size == b->size &&
+	       a->mtime_sec == b->mtime_sec &&
+	       a->mtime_nsec == b->mtime_nsec &&
+	       a->dev == b->dev &&
+	       a->ino == b->ino &&
+	       a->fingerprint == b->fingerprint;
+}
+
+/*
+ * Look up the cached section table of fname. The index must have been
+ * written with at least the verification flags in need_flags. Returns
+ * the number of sections with a malloc'd table in *out, or -1 if there
+ * is no usable index. A table with a section outside of the current
+ * image is not usable either, whatever its header says.
+ */
+int index_load(const char *fname, unsigned int need_flags, struct section_info **out)
+{
+	struct index_header want, hdr;
+	struct section_info *sections;
+	char path[PATH_MAX];
+	uint32_t i;
+	FILE *fd;
+
+	if (index_revalidate)
+		return -1;
+
+	if (index_identify(fname, &want, path, sizeof(path)))
+		return -1;
+
+	fd = fopen(path, "rb");
+	if (!fd)
+		return -1;
+
+	if (fread(&hdr, sizeof(hdr), 1, fd) != 1 || !index_matches(&want, &hdr) ||
+	    (hdr.flags & need_flags) != need_flags) {
+		fclose(fd);
+		return -1;
+	}
+
+	sections = malloc((hdr.num_sections ? hdr.num_sections : 1) * sizeof(*sections));
+	if (!sections) {
+		fclose(fd);
+		return -1;
+	}
+
+	if (fread(sections, sizeof(*sections), hdr.num_sections, fd) != hdr.num_sections) {
+		free(sections);
+		fclose(fd);
+		return -1;
+	}
+
+	fclose(fd);
+
+	for (i = 0; i < hdr.num_sections; i++) {
+		if (sections[i].offset < 0 || sections[i].length > want.size ||
+		    (uint64_t) sections[i].offset > want.size - sections[i].length) {
+			free(sections);
+			return -1;
+		}
+	}
+
+	*out = sections;
+	return hdr.num_sections;
+}
+
+/*
+ * Store the section table of fname. Verification flags recorded by an
+ * earlier index of the same, unchanged image are kept. Failing to write
+ * the cache is not an error; it just won't be there next time.
+ */
+int index_save(const char *fname, unsigned int flags,
+	       const struct section_info *sections, int num_sections)
+{
+	struct index_header hdr, old;
+	char path[PATH_MAX], tmp_path[PATH_MAX + 32];
+	FILE *fd;
+
+	if (index_identify(fname, &hdr, path, sizeof(path)))
+		return -1;
+
+	fd = fopen(path, "rb");
+	if (fd) {
+		if (!index_revalidate && fread(&old, sizeof(old), 1, fd) == 1 &&
+		    index_matches(&hdr, &old))
+			flags |= old.flags;
+		fclose(fd);
+	}
+
+	hdr.flags = flags;
+	hdr.num_sections = num_sections;
+
+	/*
+	 * Write to a temporary file first so readers never see half an index;
+	 * one per thread, as corpus mode saves from several threads at once.
+	 */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx", path, (int) getpid(),
+		 (unsigned long) pthread_self());
+	fd = fopen(tmp_path, "wb");
+	if (!fd)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fd) != 1 ||
+	    fwrite(sections, sizeof(*sections), num_sections, fd) != (size_t) num_sections) {
+		fclose(fd);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	if (fclose(fd) || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef FWINDEX_H
+#define FWINDEX_H 1
+
+#include <stdio.h>
+#include <sys/types.h>
+
+struct section_info {
+	unsigned int header_crc;
+	unsigned int actual_crc;
+	unsigned int version;
+	unsigned int build_date;
+	unsigned int flags;
+	unsigned int magic;
+	off_t offset;
+	size_t length;
+};
+
+/* Which CRCs were checked when the index was written */
+#define INDEX_VERIFIED_H4	0x1	/* section CRCs + header global CRC */
+#define INDEX_VERIFIED_H3PLUS	0x2	/* section CRCs + trailer global CRC */
+
+/* Errors from index_scan_buf() */
+#define INDEX_SCAN_NOMEM	-1
+#define INDEX_SCAN_TRUNCATED	-2	/* a section runs past the end of the image */
+
+void index_options(int *argc, char **argv);
+int index_scan_buf(const unsigned char *buf, size_t size, struct section_info **out);
+int index_scan(FILE *fd, struct section_info **out);
+int index_load(const char *fname, unsigned int need_flags, struct section_info **out);
+int index_save(const char *fname, unsigned int flags,
+	       const struct section_info *sections, int num_sections);
+
+#endif /* FWINDEX_H */
@@ -22,148 +22,76 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-static FILE *fd;
+#include "fwindex.h"
+#include "stats.h"
 
-/* Magic is 0xA3 0x24 0xEB 0x90 */
-
-static int find_magic(void);
-static int find_magic(void)
-{
-	int c;
-	int state = 0;
-	
-	while (!feof(fd)) {
-		c = fgetc(fd);
-		if (c < 0)
-			return -1;
-
-		switch (state) {
-			case 0:
-				if (c == 0x90)
-					state = 1;
-				else
-					state = 0;
-
-				break;
-			case 1:
-				if (c == 0xEB)
-					state = 2;
-				else
-					state = 0;
-
-				break;
-
-			case 2:
-				if (c == 0x24)
-					state = 3;
-				else
-					state = 0;
-				break;
-
-			case 3:
-				if (c == 0xA3) {
-					return 0;
-
-				} else
-					state = 0;
-				break;
-
-			default:
-				fprintf(stderr, "Unexpected state %u in find_magic", state);
-				return -1;
-		}
-
-		if (c == 0x90)
-			state = 1;
-	}
-
-	return -1;
-}
-
-static unsigned int read_word(void);
-static unsigned int read_word(void)
-{
-	unsigned int r = 0;
-	r |= fgetc(fd) <<  0;
-	r |= fgetc(fd) <<  8;
-	r |= fgetc(fd) << 16;
-	r |= fgetc(fd) << 24;
-	return r;
-}
-
-/*
- * Thanks to this guy for info on the header format:
- * https://gist.github.com/2394361
- */
 int main(int argc, char **argv)
 {
 	int verbose = 0;
-	int ret = 0;
-	unsigned int crc, version, build_date, flags, magic;
-	unsigned int section_offset, num = 0;
-	int length;
+	struct section_info *sections, *s;
+	int i, num;
 	char *fname;
+	FILE *fd;
+	struct stat st;
+
+	index_options(&argc, argv);
+	stats_init(&argc, argv);
 
 	if (argc != 2) {
-		printf("Usage: %s [firmware_file]\n", argv[0]);
+		printf("Usage: %s [--revalidate] [--stats] [firmware_file]\n", argv[0]);
 		return -1;
 	}
 
 	fname = argv[1];
-	
-	fd = fopen(fname, "rb");
-	if (!fd) {
-		printf("Could not open %s\n", fname);
-		return -1;
-	}
 
-	while (1) {
-		ret = find_magic();
-		if (ret < 0) {
-			printf("# End of file reached.\n");
-			fclose(fd);
-			return 0;
+	stats_begin("scan");
+	num = index_load(fname, 0, &sections);
+	if (num < 0) {
+		fd = fopen(fname, "rb");
+		if (!fd) {
+			printf("Could not open %s\n", fname);
+			return -1;
 		}
-	
-		fseek(fd, -28, SEEK_CUR);
-		crc = read_word();
-		version = read_word();
-		build_date = read_word();
-		length = read_word();
-		read_word();
-		flags = read_word();
-		magic = read_word();
-		fseek(fd, 0x100-28, SEEK_CUR);
-		section_offset = ftell(fd);
-		fseek(fd, length, SEEK_CUR);
 
-		if (length < 0)
-			continue;
+		num = index_scan(fd, &sections);
+		fclose(fd);
+
+		if (num < 0) {
+			printf("Could not scan %s\n", fname);
+			return -1;
+		}
+
+		index_save(fname, 0, sections, num);
+	}
+	stats_end("scan", stat(fname, &st) ? 0 : st.st_size);
+
+	for (i = 0; i < num; i++) {
+		s = &sections[i];
 
 		if (verbose)
 		{
 			fprintf(stderr, "Section found\n");
-			fprintf(stderr, "\tCRC\t= %08x\n", crc);
-			fprintf(stderr, "\tVersion = %08x\n", version);
-			fprintf(stderr, "\tBuild\t= %08x\n", build_date);
-			fprintf(stderr, "\tLength\t= %08x\n", length);
-			fprintf(stderr, "\tFlags\t= %08x\n", flags);
-			fprintf(stderr, "\tMagic\t= %08x\n", magic);
+			fprintf(stderr, "\tCRC\t= %08x\n", s->header_crc);
+			fprintf(stderr, "\tVersion = %08x\n", s->version);
+			fprintf(stderr, "\tBuild\t= %08x\n", s->build_date);
+			fprintf(stderr, "\tLength\t= %08zx\n", s->length);
+			fprintf(stderr, "\tFlags\t= %08x\n", s->flags);
+			fprintf(stderr, "\tMagic\t= %08x\n", s->magic);
 		}
 
-		printf("# section_%d at offset %d length %d CRC 0x%08x\n",
-			num, section_offset, length, crc);
+		printf("# section_%d at offset %lld length %zu CRC 0x%08x\n",
+			i, (long long) s->offset, s->length, s->header_crc);
 #ifdef _LINUX
-		printf("dd if=$1 bs=%d skip=1 | dd iflag=fullblock of=section_%d bs=%d count=1\n",
-			section_offset, num, length);
+		printf("dd if=$1 bs=%lld skip=1 | dd iflag=fullblock of=section_%d bs=%zu count=1\n",
+			(long long) s->offset, i, s->length);
 #else
-		printf("dd if=$1 skip=%d conv=notrunc of=section_%d count=%d bs=1\n",
-			section_offset, num, length);
+		printf("dd if=$1 skip=%lld conv=notrunc of=section_%d count=%zu bs=1\n",
+			(long long) s->offset, i, s->length);
 #endif
 		printf("\n");
-		num++;
 	}
 
-	fclose(fd);
+	printf("# End of file reached.\n");
+	free(sections);
 	return 0;
 }
@@ -16,118 +16,572 @@
  *
  */
 
+#define _XOPEN_SOURCE 500	/* nftw() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+
+#include "fileio.h"
+#include "fwindex.h"
+#include "stats.h"
+#include "store.h"
+#include "workqueue.h"
 
 static FILE *fd;
+static struct store *store;
+
+/*
+ * Copy length bytes at section_offset of the input into output_name.
+ * The data is moved by the kernel where possible (see copy_range()).
+ * Only positional I/O is used on the input, so this is safe to call from
+ * several threads at once.
+ */
+static int save_section(int in_fd, const char *output_name, off_t section_offset, size_t length);
+static int save_section(int in_fd, const char *output_name, off_t section_offset, size_t length)
+{
+	int ofd, ret;
+
+	ofd = create_file(output_name);
+
+	if (ofd < 0) {
+		printf("Could not write to %s\n", output_name);
+		return -1;
+	}
+
+	ret = copy_range(in_fd, section_offset, ofd, length);
+	close(ofd);
 
-/* Magic is 0xA3 0x24 0xEB 0x90 */
+	if (ret) {
+		printf("Could not copy %zu bytes to %s\n", length, output_name);
+		return -1;
+	}
+
+	return 0;
+}
 
-static int find_magic(void);
-static int find_magic(void)
+/*
+ * Write section s out to output_name: a plain copy, or with --store, a
+ * link to the section's object in the store. map is the whole input
+ * mapped, and only needed for the store.
+ */
+static int extract_section(int in_fd, const unsigned char *map, size_t map_size,
+			   const char *output_name, const struct section_info *s,
+			   struct store_entry *e);
+static int extract_section(int in_fd, const unsigned char *map, size_t map_size,
+			   const char *output_name, const struct section_info *s,
+			   struct store_entry *e)
 {
-	int c;
-	int state = 0;
-	
-	while (!feof(fd)) {
-		c = fgetc(fd);
-		if (c < 0)
-			return -1;
+	if (!store)
+		return save_section(in_fd, output_name, s->offset, s->length);
 
-		switch (state) {
-			case 0:
-				if (c == 0x90)
-					state = 1;
-				else
-					state = 0;
-
-				break;
-			case 1:
-				if (c == 0xEB)
-					state = 2;
-				else
-					state = 0;
-
-				break;
-
-			case 2:
-				if (c == 0x24)
-					state = 3;
-				else
-					state = 0;
-				break;
-
-			case 3:
-				if (c == 0xA3) {
-					return 0;
-
-				} else
-					state = 0;
-				break;
-
-			default:
-				fprintf(stderr, "Unexpected state %u in find_magic", state);
-				return -1;
+	if ((size_t) s->offset + s->length > map_size) {
+		printf("Section at offset %lld runs past the end of the file\n", (long long) s->offset);
+		return -1;
+	}
+
+	return store_put(store, map + s->offset, s->length, output_name, e);
+}
+
+/* One "section_N" manifest entry per section */
+static struct store_entry *alloc_entries(int num);
+static struct store_entry *alloc_entries(int num)
+{
+	struct store_entry *entries;
+	char name_buf[20];
+	int i;
+
+	entries = calloc(num ? num : 1, sizeof(*entries));
+	if (!entries)
+		return NULL;
+
+	for (i = 0; i < num; i++) {
+		snprintf(name_buf, 20, "section_%d", i);
+		entries[i].name = strdup(name_buf);
+	}
+
+	return entries;
+}
+
+static void free_entries(struct store_entry *entries, int num);
+static void free_entries(struct store_entry *entries, int num)
+{
+	int i;
+
+	if (!entries)
+		return;
+
+	for (i = 0; i < num; i++)
+		free((char *) entries[i].name);
+	free(entries);
+}
+
+static unsigned char *in_map;
+static size_t in_map_size;
+static struct store_entry *in_entries;
+
+static int save_section_job(void *ctx, int job);
+static int save_section_job(void *ctx, int job)
+{
+	struct section_info *section = (struct section_info *) ctx + job;
+	char name_buf[20];
+
+	snprintf(name_buf, 20, "section_%d", job);
+	return extract_section(fileno(fd), in_map, in_map_size, name_buf, section,
+			       in_entries ? &in_entries[job] : NULL);
+}
+
+/*
+ * Corpus mode: unpack any number of firmware files, each into its own
+ * directory under a common output directory. All files are scanned on
+ * the thread pool first; then every section of every file becomes one
+ * job, so a few large images and many small ones keep all threads busy
+ * alike. Jobs are handed out in file order, so only a handful of inputs
+ * are open at any time, and each input is dropped from the page cache
+ * once its last section has been written.
+ */
+struct corpus_file {
+	char *path;
+	char *outdir;
+	struct section_info *sections;
+	int num_sections;
+	int in_fd;
+	unsigned char *map;		/* with --store only */
+	size_t map_size;
+	struct store_entry *entries;
+	int pending;			/* sections left to write */
+	const char *error;
+	unsigned long long bytes;
+};
+
+struct corpus_job {
+	int file;
+	int section;
+};
+
+static struct corpus_file *corpus_files;
+static int corpus_nfiles, corpus_max_files;
+static struct corpus_job *corpus_jobs;
+static pthread_mutex_t corpus_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t corpus_root_len;
+
+static int corpus_add(const char *path, const char *outdir);
+static int corpus_add(const char *path, const char *outdir)
+{
+	struct corpus_file *f, *tmp;
+
+	if (corpus_nfiles == corpus_max_files) {
+		corpus_max_files = corpus_max_files ? corpus_max_files * 2 : 256;
+		tmp = realloc(corpus_files, corpus_max_files * sizeof(*corpus_files));
+		if (!tmp) {
+			printf("Could not allocate file list\n");
+			return -1;
 		}
+		corpus_files = tmp;
+	}
 
-		if (c == 0x90)
-			state = 1;
+	f = &corpus_files[corpus_nfiles];
+	memset(f, 0, sizeof(*f));
+	f->path = strdup(path);
+	f->outdir = strdup(outdir);
+	f->in_fd = -1;
+	if (!f->path || !f->outdir) {
+		printf("Could not allocate file list\n");
+		return -1;
 	}
 
-	return -1;
+	corpus_nfiles++;
+	return 0;
 }
 
-static unsigned int read_word(void);
-static unsigned int read_word(void)
+/* Files found under a directory keep their path relative to it */
+static int corpus_add_tree(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static int corpus_add_tree(const char *path, const struct stat *st, int type, struct FTW *ftw)
 {
-	unsigned int r = 0;
-	r |= fgetc(fd) <<  0;
-	r |= fgetc(fd) <<  8;
-	r |= fgetc(fd) << 16;
-	r |= fgetc(fd) << 24;
-	return r;
+	(void) st;
+	(void) ftw;
+
+	if (type != FTW_F)
+		return 0;
+
+	return corpus_add(path, path + corpus_root_len);
 }
 
-static int save_section(const char *output_name, int length);
-static int save_section(const char *output_name, int length)
+static int corpus_add_arg(const char *arg);
+static int corpus_add_arg(const char *arg)
 {
-	FILE *ofd;
-	int i;
-	char t;
-	ofd = fopen(output_name, "wb+");
+	const char *base;
+	struct stat st;
+	char line[PATH_MAX];
+	FILE *list;
+	int ret = 0;
 
-	if (!ofd) {
-		printf("Could not write to %s\n", output_name);
+	/* @file reads a list of files and directories, one per line */
+	if (arg[0] == '@') {
+		list = fopen(arg + 1, "r");
+		if (!list) {
+			printf("Could not open file list %s\n", arg + 1);
+			return -1;
+		}
+
+		while (!ret && fgets(line, sizeof(line), list)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0])
+				ret = corpus_add_arg(line);
+		}
+
+		fclose(list);
+		return ret;
+	}
+
+	if (stat(arg, &st)) {
+		printf("Could not stat %s\n", arg);
 		return -1;
 	}
 
-	for (i = 0; i < length; i++) {
-		fread(&t, 1, 1, fd);
-		fwrite(&t, 1, 1, ofd);
+	if (S_ISDIR(st.st_mode)) {
+		corpus_root_len = strlen(arg);
+		while (arg[corpus_root_len - 1] == '/' && corpus_root_len > 1)
+			corpus_root_len--;
+		corpus_root_len++;
+
+		if (nftw(arg, corpus_add_tree, 32, FTW_PHYS)) {
+			printf("Could not read directory tree %s\n", arg);
+			return -1;
+		}
+		return 0;
 	}
-	fclose(ofd);
+
+	base = strrchr(arg, '/');
+	return corpus_add(arg, base ? base + 1 : arg);
+}
+
+static int corpus_outdir_cmp(const void *a, const void *b);
+static int corpus_outdir_cmp(const void *a, const void *b)
+{
+	const struct corpus_file *fa = *(struct corpus_file * const *) a;
+	const struct corpus_file *fb = *(struct corpus_file * const *) b;
+	int ret = strcmp(fa->outdir, fb->outdir);
+
+	/* Keep the order stable, so the first one keeps its plain name */
+	if (!ret)
+		ret = (fa > fb) - (fa < fb);
+	return ret;
+}
+
+/* Give files that would unpack into the same directory distinct ones */
+static int corpus_unique_outdirs(void);
+static int corpus_unique_outdirs(void)
+{
+	struct corpus_file **sorted;
+	char *name;
+	int i, first = 0;
+	size_t len;
+
+	sorted = malloc((corpus_nfiles ? corpus_nfiles : 1) * sizeof(*sorted));
+	if (!sorted)
+		return -1;
+
+	for (i = 0; i < corpus_nfiles; i++)
+		sorted[i] = &corpus_files[i];
+	qsort(sorted, corpus_nfiles, sizeof(*sorted), corpus_outdir_cmp);
+
+	for (i = 1; i < corpus_nfiles; i++) {
+		if (strcmp(sorted[i]->outdir, sorted[first]->outdir)) {
+			first = i;
+			continue;
+		}
+
+		len = strlen(sorted[i]->outdir) + 16;
+		name = malloc(len);
+		if (!name) {
+			free(sorted);
+			return -1;
+		}
+		snprintf(name, len, "%s.%d", sorted[i]->outdir, i - first + 1);
+		free(sorted[i]->outdir);
+		sorted[i]->outdir = name;
+	}
+
+	free(sorted);
 	return 0;
 }
 
-/*
- * Thanks to this guy for info on the header format:
- * https://gist.github.com/2394361
- */
+/* mkdir -p */
+static int make_path(char *path);
+static int make_path(char *path)
+{
+	char *p;
+
+	for (p = path + 1; *p; p++) {
+		if (*p != '/')
+			continue;
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return mkdir(path, 0755) && errno != EEXIST ? -1 : 0;
+}
+
+static int corpus_scan_job(void *ctx, int job);
+static int corpus_scan_job(void *ctx, int job)
+{
+	struct corpus_file *f = &corpus_files[job];
+	FILE *in;
+
+	(void) ctx;
+
+	f->num_sections = index_load(f->path, 0, &f->sections);
+	if (f->num_sections >= 0)
+		return 0;
+
+	in = fopen(f->path, "rb");
+	if (!in) {
+		f->error = "could not open";
+		return -1;
+	}
+
+	f->num_sections = index_scan(in, &f->sections);
+	if (f->num_sections < 0)
+		f->error = "could not scan";
+	else
+		index_save(f->path, 0, f->sections, f->num_sections);
+
+	fclose(in);
+	return f->error ? -1 : 0;
+}
+
+static int corpus_section_job(void *ctx, int job);
+static int corpus_section_job(void *ctx, int job)
+{
+	struct corpus_job *j = &corpus_jobs[job];
+	struct corpus_file *f = &corpus_files[j->file];
+	struct section_info *s = &f->sections[j->section];
+	char name[PATH_MAX];
+	int in_fd, ret = -1;
+
+	(void) ctx;
+
+	pthread_mutex_lock(&corpus_lock);
+	if (f->in_fd < 0 && !f->error) {
+		f->in_fd = open(f->path, O_RDONLY);
+		if (f->in_fd < 0)
+			f->error = "could not open";
+		else if (store && !(f->map = map_file(f->path, &f->map_size, 0)))
+			f->error = "could not map";
+	}
+	in_fd = f->error ? -1 : f->in_fd;
+	pthread_mutex_unlock(&corpus_lock);
+
+	if (in_fd >= 0) {
+		snprintf(name, sizeof(name), "%s/section_%d", f->outdir, j->section);
+		ret = extract_section(in_fd, f->map, f->map_size, name, s,
+				      store ? &f->entries[j->section] : NULL);
+	}
+
+	pthread_mutex_lock(&corpus_lock);
+	if (ret && !f->error)
+		f->error = "could not write all sections";
+	if (!ret)
+		f->bytes += s->length;
+	if (--f->pending == 0 && f->in_fd >= 0) {
+		unmap_file(f->map, f->map_size);
+		f->map = NULL;
+		drop_cache(f->in_fd);
+		close(f->in_fd);
+		f->in_fd = -1;
+	}
+	pthread_mutex_unlock(&corpus_lock);
+
+	return ret;
+}
+
+static double now(void);
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int unpack_corpus(const char *outdir, int nargs, char **args, int nthreads);
+static int unpack_corpus(const char *outdir, int nargs, char **args, int nthreads)
+{
+	struct corpus_file *f;
+	char path[PATH_MAX];
+	unsigned long long total = 0;
+	int i, j, num_jobs = 0, failed = 0, ret = -1;
+	double start = now(), elapsed;
+
+	for (i = 0; i < nargs; i++)
+		if (corpus_add_arg(args[i]))
+			goto out;
+
+	if (corpus_unique_outdirs())
+		goto out;
+
+	printf("Scanning %d firmware files\n", corpus_nfiles);
+	stats_begin("scan");
+	work_run(nthreads, corpus_nfiles, corpus_scan_job, NULL);
+	stats_end("scan", 0);
+
+	for (i = 0; i < corpus_nfiles; i++) {
+		f = &corpus_files[i];
+		if (f->error)
+			continue;
+
+		if (f->num_sections == 0) {
+			f->error = "no sections found";
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "%s/%s", outdir, f->outdir);
+		free(f->outdir);
+		f->outdir = strdup(path);
+		if (!f->outdir || make_path(f->outdir)) {
+			printf("Could not create %s\n", path);
+			goto out;
+		}
+
+		if (store && !(f->entries = alloc_entries(f->num_sections))) {
+			printf("Could not allocate manifest\n");
+			goto out;
+		}
+
+		f->pending = f->num_sections;
+		num_jobs += f->num_sections;
+	}
+
+	corpus_jobs = malloc((num_jobs ? num_jobs : 1) * sizeof(*corpus_jobs));
+	if (!corpus_jobs) {
+		printf("Could not allocate %d jobs\n", num_jobs);
+		goto out;
+	}
+
+	num_jobs = 0;
+	for (i = 0; i < corpus_nfiles; i++) {
+		for (j = 0; j < corpus_files[i].pending; j++) {
+			corpus_jobs[num_jobs].file = i;
+			corpus_jobs[num_jobs].section = j;
+			num_jobs++;
+		}
+	}
+
+	printf("Writing %d sections\n", num_jobs);
+	stats_begin("write");
+	work_run(nthreads, num_jobs, corpus_section_job, NULL);
+
+	printf("\n");
+	for (i = 0; i < corpus_nfiles; i++) {
+		f = &corpus_files[i];
+		total += f->bytes;
+
+		if (!f->error && store) {
+			snprintf(path, sizeof(path), "%s/MANIFEST", f->outdir);
+			if (store_write_manifest(path, f->entries, f->num_sections))
+				f->error = "could not write manifest";
+		}
+
+		if (f->error) {
+			printf("FAILED %s: %s\n", f->path, f->error);
+			failed++;
+		} else {
+			printf("OK     %s -> %s (%d sections, %llu bytes)\n",
+			       f->path, f->outdir, f->num_sections, f->bytes);
+		}
+	}
+	stats_end("write", total);
+
+	elapsed = now() - start;
+	printf("\n%d files, %d unpacked, %d failed, %d sections, %llu bytes in %.2f s (%.1f MB/s)\n",
+	       corpus_nfiles, corpus_nfiles - failed, failed, num_jobs, total, elapsed,
+	       elapsed > 0 ? total / (1024.0 * 1024.0) / elapsed : 0);
+
+	ret = failed ? -1 : 0;
+out:
+	for (i = 0; i < corpus_nfiles; i++) {
+		free(corpus_files[i].path);
+		free(corpus_files[i].outdir);
+		free(corpus_files[i].sections);
+		free_entries(corpus_files[i].entries, corpus_files[i].num_sections);
+	}
+	free(corpus_files);
+	free(corpus_jobs);
+	return ret;
+}
+
+static void print_usage(const char *name);
+static void print_usage(const char *name)
+{
+	printf("Usage: %s [--revalidate] [--stats] [--store dir] [-j threads] [firmware_file]\n", name);
+	printf("       %s [--revalidate] [--stats] [--store dir] [-j threads] --corpus output_dir file|dir|@list...\n", name);
+	printf("\t-j threads\tfind all sections first, then write them from\n");
+	printf("\t\t\tthis many threads at once (0 = one per CPU)\n");
+	printf("\t--stats\t\tprint timings, throughput and peak memory use\n");
+	printf("\t--store dir\tkeep one copy of every distinct section in a\n");
+	printf("\t\t\tcontent-addressed store, hard link the section files\n");
+	printf("\t\t\tto it and list them in a MANIFEST\n");
+	printf("\t--corpus\tunpack every firmware file given, found under the\n");
+	printf("\t\t\tdirectories given or listed in @list files, each into\n");
+	printf("\t\t\tits own directory under output_dir\n");
+}
+
 int main(int argc, char **argv)
 {
 	int verbose = 0;
 	int ret = 0;
-	unsigned int crc, version, build_date, flags, magic;
-	unsigned int section_offset, num = 0;
-	int length;
+	struct section_info *sections, *s;
+	int i, num;
 	char *fname;
 	char name_buf[20];
+	int parallel = 0, nthreads = 0;
+	unsigned long long total = 0;
+	struct stat st;
+
+	index_options(&argc, argv);
+	stats_init(&argc, argv);
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--store") == 0) {
+			store = store_open(argv[i + 1]);
+			if (!store)
+				return -1;
+			memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(*argv));
+			argc -= 2;
+			break;
+		}
+	}
+
+	if (argc >= 4 && strcmp(argv[1], "-j") == 0) {
+		parallel = 1;
+		nthreads = atoi(argv[2]);
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc >= 4 && strcmp(argv[1], "--corpus") == 0) {
+		ret = unpack_corpus(argv[2], argc - 3, argv + 3, nthreads);
+		store_close(store);
+		return ret;
+	}
 
 	if (argc != 2) {
-		printf("Usage: %s [firmware_file]\n", argv[0]);
+		print_usage(argv[0]);
 		return -1;
 	}
 
@@ -139,48 +593,67 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	while (1) {
-		ret = find_magic();
-		if (ret < 0) {
-			printf("End of file reached.\n");
+	stats_begin("scan");
+	num = index_load(fname, 0, &sections);
+	if (num < 0) {
+		num = index_scan(fd, &sections);
+		if (num < 0) {
+			printf("Could not scan %s\n", fname);
 			fclose(fd);
-			return 0;
+			return -1;
 		}
-	
-		fseek(fd, -28, SEEK_CUR);
-		crc = read_word();
-		version = read_word();
-		build_date = read_word();
-		length = read_word();
-		read_word();
-		flags = read_word();
-		magic = read_word();
-		fseek(fd, 0x100-28, SEEK_CUR);
-		section_offset = ftell(fd);
-
-		if (length < 0)
-			continue;
+		index_save(fname, 0, sections, num);
+	}
+	stats_end("scan", fstat(fileno(fd), &st) ? 0 : st.st_size);
+
+	if (store) {
+		in_map = map_file(fname, &in_map_size, 0);
+		in_entries = alloc_entries(num);
+		if (!in_map || !in_entries) {
+			printf("Could not read %s into the store\n", fname);
+			return -1;
+		}
+	}
+
+	stats_begin("write");
+	for (i = 0; i < num; i++) {
+		s = &sections[i];
 
 		if (verbose)
 		{
 			fprintf(stderr, "Section found\n");
-			fprintf(stderr, "\tCRC\t= %08x\n", crc);
-			fprintf(stderr, "\tVersion = %08x\n", version);
-			fprintf(stderr, "\tBuild\t= %08x\n", build_date);
-			fprintf(stderr, "\tLength\t= %08x\n", length);
-			fprintf(stderr, "\tFlags\t= %08x\n", flags);
-			fprintf(stderr, "\tMagic\t= %08x\n", magic);
+			fprintf(stderr, "\tCRC\t= %08x\n", s->header_crc);
+			fprintf(stderr, "\tVersion = %08x\n", s->version);
+			fprintf(stderr, "\tBuild\t= %08x\n", s->build_date);
+			fprintf(stderr, "\tLength\t= %08zx\n", s->length);
+			fprintf(stderr, "\tFlags\t= %08x\n", s->flags);
+			fprintf(stderr, "\tMagic\t= %08x\n", s->magic);
 		}
 
-		snprintf(name_buf, 20, "section_%d", num);
-		printf("Saving section %d to %s at offset %d len %d CRC 0x%08x\n",
-			num, name_buf, section_offset, length, crc);
+		snprintf(name_buf, 20, "section_%d", i);
+		printf("Saving section %d to %s at offset %lld len %zu CRC 0x%08x\n",
+			i, name_buf, (long long) s->offset, s->length, s->header_crc);
 
-		save_section(name_buf, length);
-		
-		num++;
+		/* In parallel mode everything is written out below instead */
+		if (!parallel && save_section_job(sections, i))
+			ret = -1;
+		total += s->length;
 	}
 
+	if (parallel)
+		ret = work_run(nthreads, num, save_section_job, sections);
+	stats_end("write", total);
+
+	if (store) {
+		if (store_write_manifest("MANIFEST", in_entries, num))
+			ret = -1;
+		free_entries(in_entries, num);
+		unmap_file(in_map, in_map_size);
+		store_close(store);
+	}
+
+	printf("End of file reached.\n");
+	free(sections);
 	fclose(fd);
-	return 0;
+	return ret;
 }
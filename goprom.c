@@ -16,12 +16,26 @@
  *
  */
 
+#define _XOPEN_SOURCE 500	/* nftw() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <fnmatch.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "stats.h"
+#include "store.h"
+#include "workqueue.h"
 
 struct inode {
 	char name[0x73];
@@ -42,7 +56,933 @@ static unsigned int read_word(FILE *fd)
 	return r;
 }
 
+static void write_word(FILE *fd, unsigned int word);
+static void write_word(FILE *fd, unsigned int word)
+{
+	fputc(word >>  0, fd);
+	fputc(word >>  8, fd);
+	fputc(word >> 16, fd);
+	fputc(word >> 24, fd);
+}
+
 #define INODE_MAGIC 0x2387AB76
+#define INODE_TABLE_OFFSET 0x800
+
+/*
+ * Read the whole inode table in one go, as it is on disk. Returns a
+ * malloc'd array of nfiles inodes, or NULL on error.
+ */
+static struct inode *load_inode_table(FILE *fd, int nfiles);
+static struct inode *load_inode_table(FILE *fd, int nfiles)
+{
+	struct inode *inodes;
+
+	inodes = malloc((nfiles ? nfiles : 1) * sizeof(struct inode));
+	if (!inodes) {
+		fprintf(stderr, "Could not allocate %d inodes\n", nfiles);
+		return NULL;
+	}
+
+	fseek(fd, INODE_TABLE_OFFSET, SEEK_SET);
+	if (fread(inodes, sizeof(struct inode), nfiles, fd) != (size_t) nfiles) {
+		fprintf(stderr, "Could not read inode table\n");
+		free(inodes);
+		return NULL;
+	}
+
+	return inodes;
+}
+
+/* Like load_inode_table(), but check the magic and terminate the names */
+static struct inode *read_inodes(FILE *fd, int nfiles);
+static struct inode *read_inodes(FILE *fd, int nfiles)
+{
+	struct inode *inodes;
+	int i;
+
+	inodes = load_inode_table(fd, nfiles);
+	if (!inodes)
+		return NULL;
+
+	for (i = 0; i < nfiles; i++) {
+		if (inodes[i].magic != INODE_MAGIC) {
+			fprintf(stderr, "Unknown inode magic: %08x\n", inodes[i].magic);
+			free(inodes);
+			return NULL;
+		}
+		inodes[i].name[sizeof(inodes[i].name) - 1] = '\0';
+	}
+
+	return inodes;
+}
+
+/*
+ * Directories already created during extraction, so that each one costs
+ * a single mkdir() no matter how many files live in it.
+ */
+#define DIR_HASH_SIZE	1024
+
+struct dir_entry {
+	struct dir_entry *next;
+	char path[1];
+};
+
+static struct dir_entry *dir_hash[DIR_HASH_SIZE];
+
+static unsigned int hash_string(const char *str);
+static unsigned int hash_string(const char *str)
+{
+	unsigned int h = 2166136261U;	/* FNV-1a */
+
+	while (*str) {
+		h ^= (unsigned char) *str++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/* Create path, and its parents, unless this was already done */
+static int make_dirs(const char *path);
+static int make_dirs(const char *path)
+{
+	struct dir_entry *dir;
+	unsigned int h = hash_string(path) % DIR_HASH_SIZE;
+	char *slash;
+
+	for (dir = dir_hash[h]; dir; dir = dir->next)
+		if (strcmp(dir->path, path) == 0)
+			return 0;
+
+	dir = malloc(sizeof(*dir) + strlen(path));
+	if (!dir)
+		return -1;
+	strcpy(dir->path, path);
+
+	slash = strrchr(dir->path, '/');
+	if (slash && slash != dir->path) {
+		*slash = '\0';
+		if (make_dirs(dir->path)) {
+			free(dir);
+			return -1;
+		}
+		*slash = '/';
+	}
+
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Could not create directory %s\n", path);
+		free(dir);
+		return -1;
+	}
+
+	dir->next = dir_hash[h];
+	dir_hash[h] = dir;
+	return 0;
+}
+
+static void free_dirs(void);
+static void free_dirs(void)
+{
+	struct dir_entry *dir, *next;
+	int i;
+
+	for (i = 0; i < DIR_HASH_SIZE; i++) {
+		for (dir = dir_hash[i]; dir; dir = next) {
+			next = dir->next;
+			free(dir);
+		}
+		dir_hash[i] = NULL;
+	}
+}
+
+/*
+ * Turn an inode name into a path under outdir. Leading slashes are
+ * dropped and ".." components refused, so nothing is ever written
+ * outside of outdir.
+ */
+static int output_path(char *path, size_t size, const char *outdir, const char *name);
+static int output_path(char *path, size_t size, const char *outdir, const char *name)
+{
+	const char *p;
+
+	while (*name == '/')
+		name++;
+
+	for (p = name; *p; ) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+			return -1;
+		p = strchr(p, '/');
+		if (!p)
+			break;
+		while (*p == '/')
+			p++;
+	}
+
+	if (*name == '\0')
+		return -1;
+
+	if ((size_t) snprintf(path, size, "%s/%s", outdir, name) >= size)
+		return -1;
+
+	return 0;
+}
+
+struct extract_ctx {
+	int in_fd;
+	long section_size;
+	const char *outdir;
+	struct inode *inodes;
+	struct store *store;		/* --store only */
+	unsigned char *map;
+	struct store_entry *entries;
+};
+
+static int extract_job(void *ctx, int job);
+static int extract_job(void *ctx, int job)
+{
+	struct extract_ctx *x = ctx;
+	struct inode *d = &x->inodes[job];
+	char path[PATH_MAX];
+	int ofd, ret;
+
+	if (d->offset < 0 || d->len < 0 || d->offset + (long) d->len > x->section_size) {
+		fprintf(stderr, "%s: data lies outside of the section\n", d->name);
+		return -1;
+	}
+
+	if (output_path(path, sizeof(path), x->outdir, d->name))
+		return -1;
+
+	if (x->store) {
+		x->entries[job].name = d->name;
+		return store_put(x->store, x->map + d->offset, d->len, path, &x->entries[job]);
+	}
+
+	ofd = create_file(path);
+	if (ofd < 0) {
+		fprintf(stderr, "Could not write to %s\n", path);
+		return -1;
+	}
+
+	ret = copy_range(x->in_fd, d->offset, ofd, d->len);
+	close(ofd);
+
+	if (ret)
+		fprintf(stderr, "Could not copy %d bytes to %s\n", d->len, path);
+
+	return ret;
+}
+
+/*
+ * Unpack every file in the romfs into outdir. The directories are made
+ * up front; the file contents are then copied by a pool of threads
+ * straight from the section at their inode offsets.
+ */
+static int extract_all(FILE *fd, struct inode *inodes, int nfiles, const char *outdir,
+		       struct store *store, const char *section_name);
+static int extract_all(FILE *fd, struct inode *inodes, int nfiles, const char *outdir,
+		       struct store *store, const char *section_name)
+{
+	struct extract_ctx x;
+	char path[PATH_MAX];
+	char *slash;
+	struct stat st;
+	size_t map_size;
+	int i, ret = 0;
+
+	if (fstat(fileno(fd), &st)) {
+		fprintf(stderr, "Could not stat romfs section\n");
+		return -1;
+	}
+
+	if (make_dirs(outdir))
+		return -1;
+
+	for (i = 0; i < nfiles; i++) {
+		if (output_path(path, sizeof(path), outdir, inodes[i].name)) {
+			fprintf(stderr, "Refusing to extract %s\n", inodes[i].name);
+			ret = -1;
+			continue;
+		}
+
+		slash = strrchr(path, '/');
+		*slash = '\0';
+		if (make_dirs(path))
+			ret = -1;
+	}
+
+	free_dirs();
+
+	if (ret)
+		return ret;
+
+	x.in_fd = fileno(fd);
+	x.section_size = st.st_size;
+	x.outdir = outdir;
+	x.inodes = inodes;
+	x.store = store;
+
+	if (!store)
+		return work_run(0, nfiles, extract_job, &x);
+
+	/* The store wants the data in memory; map the whole section */
+	x.map = map_file(section_name, &map_size, 0);
+	x.entries = calloc(nfiles ? nfiles : 1, sizeof(*x.entries));
+	if (!x.map || !x.entries) {
+		fprintf(stderr, "Could not read romfs section into the store\n");
+		free(x.entries);
+		return -1;
+	}
+
+	ret = work_run(0, nfiles, extract_job, &x);
+
+	snprintf(path, sizeof(path), "%s/MANIFEST", outdir);
+	if (!ret)
+		ret = store_write_manifest(path, x.entries, nfiles);
+
+	free(x.entries);
+	unmap_file(x.map, map_size);
+	return ret;
+}
+
+/*
+ * Index of the inode table by name, so that a single file can be found
+ * without comparing every name. Leading slashes are not significant.
+ */
+struct name_index {
+	int *bucket;
+	int *next;
+	unsigned int mask;
+};
+
+static const char *skip_slashes(const char *name);
+static const char *skip_slashes(const char *name)
+{
+	while (*name == '/')
+		name++;
+	return name;
+}
+
+static int index_names(struct name_index *idx, struct inode *inodes, int nfiles);
+static int index_names(struct name_index *idx, struct inode *inodes, int nfiles)
+{
+	unsigned int size = 16, h;
+	int i;
+
+	while (size < (unsigned int) nfiles * 2)
+		size *= 2;
+
+	idx->mask = size - 1;
+	idx->bucket = malloc(size * sizeof(*idx->bucket));
+	idx->next = malloc((nfiles ? nfiles : 1) * sizeof(*idx->next));
+	if (!idx->bucket || !idx->next) {
+		fprintf(stderr, "Could not allocate name index\n");
+		free(idx->bucket);
+		free(idx->next);
+		return -1;
+	}
+
+	memset(idx->bucket, 0xff, size * sizeof(*idx->bucket));
+
+	/* Insert back to front so that lookups find the first of any duplicates */
+	for (i = nfiles - 1; i >= 0; i--) {
+		h = hash_string(skip_slashes(inodes[i].name)) & idx->mask;
+		idx->next[i] = idx->bucket[h];
+		idx->bucket[h] = i;
+	}
+
+	return 0;
+}
+
+static int lookup_name(struct name_index *idx, struct inode *inodes, const char *name);
+static int lookup_name(struct name_index *idx, struct inode *inodes, const char *name)
+{
+	int i;
+
+	name = skip_slashes(name);
+	for (i = idx->bucket[hash_string(name) & idx->mask]; i >= 0; i = idx->next[i])
+		if (strcmp(skip_slashes(inodes[i].name), name) == 0)
+			return i;
+
+	return -1;
+}
+
+static void list_files(struct inode *inodes, int nfiles);
+static void list_files(struct inode *inodes, int nfiles)
+{
+	int i;
+
+	for (i = 0; i < nfiles; i++)
+		printf("%08x %10d %s\n", inodes[i].offset, inodes[i].len, inodes[i].name);
+}
+
+/* Copy one file out of the section, to outdir or to stdout if outdir is "-" */
+static int extract_one(int in_fd, long section_size, struct inode *d, const char *outdir);
+static int extract_one(int in_fd, long section_size, struct inode *d, const char *outdir)
+{
+	char path[PATH_MAX];
+	char *slash;
+	int ofd, ret;
+
+	if (d->offset < 0 || d->len < 0 || d->offset + (long) d->len > section_size) {
+		fprintf(stderr, "%s: data lies outside of the section\n", d->name);
+		return -1;
+	}
+
+	if (strcmp(outdir, "-") == 0) {
+		fflush(stdout);
+		ret = copy_range(in_fd, d->offset, STDOUT_FILENO, d->len);
+		if (ret)
+			fprintf(stderr, "Could not copy %s to stdout\n", d->name);
+		return ret;
+	}
+
+	if (output_path(path, sizeof(path), outdir, d->name)) {
+		fprintf(stderr, "Refusing to extract %s\n", d->name);
+		return -1;
+	}
+
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	ret = make_dirs(path);
+	*slash = '/';
+	if (ret)
+		return -1;
+
+	ofd = create_file(path);
+	if (ofd < 0) {
+		fprintf(stderr, "Could not write to %s\n", path);
+		return -1;
+	}
+
+	ret = copy_range(in_fd, d->offset, ofd, d->len);
+	close(ofd);
+
+	if (ret)
+		fprintf(stderr, "Could not copy %d bytes to %s\n", d->len, path);
+	else
+		fprintf(stderr, "%s\n", path);
+
+	return ret;
+}
+
+/*
+ * Extract the files matching pattern. A plain path is looked up in the
+ * name index; a pattern with wildcards is matched against every name
+ * with fnmatch(), where '*' also matches across directories. Only the
+ * data of the matching files is read.
+ */
+static int extract_files(FILE *fd, struct inode *inodes, int nfiles, const char *pattern,
+			 const char *outdir);
+static int extract_files(FILE *fd, struct inode *inodes, int nfiles, const char *pattern,
+			 const char *outdir)
+{
+	struct name_index idx;
+	struct stat st;
+	int i, found = 0, ret = 0;
+
+	if (fstat(fileno(fd), &st)) {
+		fprintf(stderr, "Could not stat romfs section\n");
+		return -1;
+	}
+
+	if (!strpbrk(pattern, "*?[")) {
+		if (index_names(&idx, inodes, nfiles))
+			return -1;
+
+		i = lookup_name(&idx, inodes, pattern);
+		if (i >= 0) {
+			found = 1;
+			ret = extract_one(fileno(fd), st.st_size, &inodes[i], outdir);
+		}
+
+		free(idx.bucket);
+		free(idx.next);
+	} else {
+		pattern = skip_slashes(pattern);
+		for (i = 0; i < nfiles; i++) {
+			if (fnmatch(pattern, skip_slashes(inodes[i].name), 0))
+				continue;
+
+			found++;
+			if (extract_one(fileno(fd), st.st_size, &inodes[i], outdir))
+				ret = -1;
+		}
+	}
+
+	free_dirs();
+
+	if (!found) {
+		fprintf(stderr, "No file matches %s\n", pattern);
+		return -1;
+	}
+
+	return ret;
+}
+
+/*
+ * romfs consistency check. Every inode is checked on its own (magic,
+ * name, extent within the section and past the inode table), then the
+ * extents are sorted by offset so overlaps and gaps between them show up
+ * in a single pass. Files with identical contents may share one extent,
+ * as --build lays them out; any other overlap is an error. Unused space
+ * is reported but is not an error.
+ */
+#define CHECK_MAX_REPORTS	20
+
+struct extent {
+	long offset;
+	long len;
+	int inode;
+};
+
+static int extent_cmp(const void *a, const void *b);
+static int extent_cmp(const void *a, const void *b)
+{
+	const struct extent *x = a, *y = b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return x->inode - y->inode;
+}
+
+static int check_problem(int *problems, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static int check_problem(int *problems, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (++*problems > CHECK_MAX_REPORTS)
+		return -1;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	return -1;
+}
+
+static int check_romfs(FILE *fd, int nfiles);
+static int check_romfs(FILE *fd, int nfiles)
+{
+	struct inode *inodes, *d;
+	struct extent *ext;
+	struct name_index idx;
+	struct stat st;
+	long table_end, end, slack = 0, largest_gap = 0, data = 0;
+	int i, j, num_ext = 0, problems = 0, shared = 0, gaps = 0, last = -1;
+
+	if (fstat(fileno(fd), &st)) {
+		fprintf(stderr, "Could not stat romfs section\n");
+		return -1;
+	}
+
+	table_end = INODE_TABLE_OFFSET + (long) nfiles * sizeof(struct inode);
+	if (table_end > st.st_size) {
+		fprintf(stderr, "Inode table (%d files) runs past the end of the %ld byte section\n",
+			nfiles, (long) st.st_size);
+		return -1;
+	}
+
+	inodes = load_inode_table(fd, nfiles);
+	ext = malloc((nfiles ? nfiles : 1) * sizeof(*ext));
+	if (!inodes || !ext) {
+		free(inodes);
+		free(ext);
+		return -1;
+	}
+
+	for (i = 0; i < nfiles; i++) {
+		d = &inodes[i];
+
+		if (d->magic != INODE_MAGIC)
+			check_problem(&problems, "inode %d: bad magic %08x\n", i, d->magic);
+
+		if (!memchr(d->name, '\0', sizeof(d->name))) {
+			check_problem(&problems, "inode %d: name is not NUL-terminated\n", i);
+			d->name[sizeof(d->name) - 1] = '\0';
+			continue;
+		}
+
+		if (d->name[0] == '\0') {
+			check_problem(&problems, "inode %d: empty name\n", i);
+			continue;
+		}
+
+		if (d->offset < 0 || d->len < 0 || d->offset + (long) d->len > st.st_size) {
+			check_problem(&problems, "%s: data at %08x+%x lies outside of the section\n",
+				      d->name, d->offset, d->len);
+			continue;
+		}
+
+		if (d->len && d->offset < table_end) {
+			check_problem(&problems, "%s: data at %08x overlaps the inode table\n",
+				      d->name, d->offset);
+			continue;
+		}
+
+		if (d->len) {
+			ext[num_ext].offset = d->offset;
+			ext[num_ext].len = d->len;
+			ext[num_ext].inode = i;
+			num_ext++;
+		}
+	}
+
+	if (!index_names(&idx, inodes, nfiles)) {
+		for (i = 0; i < nfiles; i++) {
+			j = lookup_name(&idx, inodes, inodes[i].name);
+			if (inodes[i].name[0] && j != i)
+				check_problem(&problems, "%s: duplicate name (inodes %d and %d)\n",
+					      inodes[i].name, j, i);
+		}
+		free(idx.bucket);
+		free(idx.next);
+	}
+
+	qsort(ext, num_ext, sizeof(*ext), extent_cmp);
+
+	end = table_end;
+	for (i = 0; i < num_ext; i++) {
+		if (ext[i].offset > end) {
+			gaps++;
+			slack += ext[i].offset - end;
+			if (ext[i].offset - end > largest_gap)
+				largest_gap = ext[i].offset - end;
+		} else if (ext[i].offset < end) {
+			if (i && ext[i].offset == ext[i - 1].offset && ext[i].len == ext[i - 1].len) {
+				shared++;
+				continue;
+			}
+			check_problem(&problems, "%s: data at %08lx+%lx overlaps %s\n",
+				      inodes[ext[i].inode].name, ext[i].offset, ext[i].len,
+				      inodes[last].name);
+		}
+
+		if (ext[i].offset + ext[i].len > end) {
+			data += ext[i].offset + ext[i].len - (ext[i].offset > end ? ext[i].offset : end);
+			end = ext[i].offset + ext[i].len;
+			last = ext[i].inode;
+		}
+	}
+
+	if (st.st_size > end) {
+		slack += st.st_size - end;
+		if (st.st_size - end > largest_gap)
+			largest_gap = st.st_size - end;
+	}
+
+	fprintf(stderr, "%d files, %ld bytes of data, %d sharing another file's data\n",
+		nfiles, data, shared);
+	fprintf(stderr, "Slack: %ld bytes in %d gaps and at the end (largest %ld), %.1f%% of the section\n",
+		slack, gaps, largest_gap, st.st_size ? 100.0 * slack / st.st_size : 0);
+
+	if (problems > CHECK_MAX_REPORTS)
+		fprintf(stderr, "... and %d more problems\n", problems - CHECK_MAX_REPORTS);
+
+	if (problems)
+		fprintf(stderr, "romfs is NOT consistent: %d problems\n", problems);
+	else
+		fprintf(stderr, "romfs OK\n");
+
+	free(ext);
+	free(inodes);
+	return problems ? -1 : 0;
+}
+
+/*
+ * romfs builder. Files are laid out after the inode table in name order,
+ * each starting on a ROMFS_DATA_ALIGN boundary (the same alignment as
+ * the inode table itself). Files with identical contents share one copy
+ * of the data.
+ */
+#define ROMFS_DATA_ALIGN	0x800
+
+struct build_file {
+	char name[sizeof(((struct inode *) 0)->name)];
+	char *path;
+	unsigned char *data;		/* mapped */
+	size_t len;
+	unsigned long crc;
+	off_t offset;
+};
+
+static struct build_file *build_files;
+static int build_nfiles, build_max_files;
+static size_t build_root_len;
+
+static int build_add_file(const char *path, const struct stat *st, int type, struct FTW *ftw);
+static int build_add_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	struct build_file *f, *tmp;
+	const char *name = path + build_root_len;
+
+	(void) st;
+	(void) ftw;
+
+	if (type != FTW_F)
+		return 0;
+
+	while (*name == '/')
+		name++;
+
+	if (strlen(name) >= sizeof(f->name)) {
+		fprintf(stderr, "File name too long for romfs: %s\n", name);
+		return -1;
+	}
+
+	if (build_nfiles >= build_max_files) {
+		build_max_files = build_max_files ? build_max_files * 2 : 256;
+		tmp = realloc(build_files, build_max_files * sizeof(*build_files));
+		if (!tmp) {
+			fprintf(stderr, "Could not allocate file list\n");
+			return -1;
+		}
+		build_files = tmp;
+	}
+
+	f = &build_files[build_nfiles];
+	memset(f, 0, sizeof(*f));
+	strcpy(f->name, name);
+	f->path = strdup(path);
+	if (!f->path)
+		return -1;
+
+	build_nfiles++;
+	return 0;
+}
+
+static int build_name_cmp(const void *a, const void *b);
+static int build_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct build_file *) a)->name,
+		      ((const struct build_file *) b)->name);
+}
+
+/* Worker: map one input file and CRC it; the mapping stays until the section is written */
+static int build_read_job(void *ctx, int job);
+static int build_read_job(void *ctx, int job)
+{
+	struct build_file *f = (struct build_file *) ctx + job;
+	unsigned char *map;
+	size_t size;
+	struct stat st;
+
+	if (stat(f->path, &st)) {
+		fprintf(stderr, "Could not stat %s\n", f->path);
+		return -1;
+	}
+
+	/* map_file() refuses empty files; those need no data anyway */
+	if (st.st_size == 0)
+		return 0;
+
+	map = map_file(f->path, &size, 0);
+	if (!map)
+		return -1;
+
+	f->data = map;
+	f->len = size;
+	f->crc = crc32_update(0L, f->data, size);
+	return 0;
+}
+
+/* Files with the same contents have the same length and CRC */
+static unsigned int build_hash(const struct build_file *f);
+static unsigned int build_hash(const struct build_file *f)
+{
+	unsigned long long len = f->len;
+
+	return (unsigned int) (f->crc ^ len ^ (len >> 32)) * 0x9E3779B1u;
+}
+
+/* Find an earlier file with the same contents among those in the dedup table */
+static struct build_file *build_find_same(int *bucket, int *next, unsigned int mask,
+					  const struct build_file *f);
+static struct build_file *build_find_same(int *bucket, int *next, unsigned int mask,
+					  const struct build_file *f)
+{
+	struct build_file *o;
+	int j;
+
+	for (j = bucket[build_hash(f) & mask]; j >= 0; j = next[j]) {
+		o = &build_files[j];
+		if (o->len == f->len && o->crc == f->crc &&
+		    (!f->len || memcmp(o->data, f->data, f->len) == 0))
+			return o;
+	}
+
+	return NULL;
+}
+
+static void build_free(void);
+static void build_free(void)
+{
+	int i;
+
+	for (i = 0; i < build_nfiles; i++) {
+		free(build_files[i].path);
+		unmap_file(build_files[i].data, build_files[i].len);
+	}
+	free(build_files);
+	build_files = NULL;
+	build_nfiles = build_max_files = 0;
+}
+
+static int write_zeros(FILE *fd, off_t count);
+static int write_zeros(FILE *fd, off_t count)
+{
+	static const unsigned char zeros[ROMFS_DATA_ALIGN];
+	size_t n;
+
+	while (count > 0) {
+		n = count < ROMFS_DATA_ALIGN ? count : ROMFS_DATA_ALIGN;
+		if (fwrite(zeros, n, 1, fd) != 1)
+			return -1;
+		count -= n;
+	}
+	return 0;
+}
+
+/*
+ * Build a fresh romfs section from the tree under root. Input files are
+ * read and CRC'd in parallel, then the section is written out in a single
+ * sequential pass.
+ */
+static int build_romfs(const char *root, const char *output_name);
+static int build_romfs(const char *root, const char *output_name)
+{
+	struct build_file *same;
+	struct inode d;
+	char tmp_path[PATH_MAX + 8];
+	FILE *ofd;
+	off_t pos;
+	size_t data_len;
+	unsigned long long total = 0;
+	int *bucket = NULL, *next = NULL;
+	unsigned int size = 16, h;
+	int i, fd, ret = -1;
+
+	build_root_len = strlen(root);
+
+	stats_begin("scan");
+	if (nftw(root, build_add_file, 32, FTW_PHYS)) {
+		fprintf(stderr, "Could not read directory tree %s\n", root);
+		goto out;
+	}
+	stats_end("scan", 0);
+
+	fprintf(stderr, "Packing %d files\n", build_nfiles);
+	qsort(build_files, build_nfiles, sizeof(*build_files), build_name_cmp);
+
+	stats_begin("read");
+	if (work_run(0, build_nfiles, build_read_job, build_files))
+		goto out;
+	for (i = 0; i < build_nfiles; i++)
+		total += build_files[i].len;
+	stats_end("read", total);
+
+	/* Files whose data is placed, hashed by length and CRC */
+	while (size < (unsigned int) build_nfiles * 2)
+		size *= 2;
+	bucket = malloc(size * sizeof(*bucket));
+	next = malloc((build_nfiles ? build_nfiles : 1) * sizeof(*next));
+	if (!bucket || !next) {
+		fprintf(stderr, "Could not allocate dedup table\n");
+		goto out;
+	}
+	memset(bucket, 0xff, size * sizeof(*bucket));
+
+	/*
+	 * Lay out the data, sharing it between files with the same contents.
+	 * Inode offsets and lengths are 32-bit signed, so the whole section
+	 * has to stay below 2 GB.
+	 */
+	pos = INODE_TABLE_OFFSET + (off_t) build_nfiles * sizeof(struct inode);
+	for (i = 0; i < build_nfiles; i++) {
+		if (build_files[i].len)
+			pos = (pos + ROMFS_DATA_ALIGN - 1) & ~(off_t) (ROMFS_DATA_ALIGN - 1);
+
+		same = build_find_same(bucket, next, size - 1, &build_files[i]);
+		if (same) {
+			build_files[i].offset = same->offset;
+			continue;
+		}
+
+		if (pos + (off_t) build_files[i].len > INT_MAX) {
+			fprintf(stderr, "%s does not fit: romfs offsets are limited to %d bytes\n",
+				build_files[i].name, INT_MAX);
+			goto out;
+		}
+		build_files[i].offset = pos;
+		pos += build_files[i].len;
+
+		h = build_hash(&build_files[i]) & (size - 1);
+		next[i] = bucket[h];
+		bucket[h] = i;
+	}
+
+	/* Build the section next to output_name and only replace it when done */
+	stats_begin("write");
+	fd = open_temp(output_name, tmp_path, sizeof(tmp_path));
+	if (fd < 0)
+		goto out;
+
+	ofd = fdopen(fd, "wb");
+	if (!ofd) {
+		fprintf(stderr, "Could not write to %s\n", tmp_path);
+		close(fd);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	/* File count, then zeros up to the inode table */
+	write_word(ofd, build_nfiles);
+	write_zeros(ofd, INODE_TABLE_OFFSET - 4);
+
+	for (i = 0; i < build_nfiles; i++) {
+		memset(&d, 0, sizeof(d));
+		strcpy(d.name, build_files[i].name);
+		d.offset = build_files[i].offset;
+		d.len = build_files[i].len;
+		d.magic = INODE_MAGIC;
+		fwrite(&d, sizeof(d), 1, ofd);
+	}
+
+	pos = INODE_TABLE_OFFSET + (off_t) build_nfiles * sizeof(struct inode);
+	for (i = 0; i < build_nfiles; i++) {
+		if (build_files[i].offset < pos)
+			continue;	/* shared with an earlier file */
+
+		write_zeros(ofd, build_files[i].offset - pos);
+		data_len = build_files[i].len;
+		if (data_len && fwrite(build_files[i].data, data_len, 1, ofd) != 1)
+			break;
+		pos = build_files[i].offset + data_len;
+	}
+
+	if (ferror(ofd) | fclose(ofd)) {
+		fprintf(stderr, "Error writing %s\n", tmp_path);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	if (rename(tmp_path, output_name)) {
+		fprintf(stderr, "Could not write to %s\n", output_name);
+		unlink(tmp_path);
+		goto out;
+	}
+
+	stats_end("write", pos);
+
+	fprintf(stderr, "Wrote %lld byte romfs section to %s\n", (long long) pos, output_name);
+	ret = 0;
+out:
+	free(next);
+	free(bucket);
+	build_free();
+	return ret;
+}
 
 static void print_usage(void);
 static void print_usage(void)
@@ -51,23 +991,96 @@ static void print_usage(void)
 	fprintf(stderr, "	goprom --unpack romfs_section > unpack-romfs.sh\n");
 	fprintf(stderr, "	Generate shell script to unpack a romfs section\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr, "	goprom [--store dir] --extract-all romfs_section [output_dir]\n");
+	fprintf(stderr, "	Unpack every file in a romfs section into output_dir (default: .)\n");
+	fprintf(stderr, "	With --store dir, each distinct file is kept once in a content-addressed\n");
+	fprintf(stderr, "	store, the extracted files are hard links to it, and output_dir/MANIFEST\n");
+	fprintf(stderr, "	lists them\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	goprom --list romfs_section\n");
+	fprintf(stderr, "	List the offset, length and name of every file in a romfs section\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	goprom --extract romfs_section path|pattern [output_dir|-]\n");
+	fprintf(stderr, "	Unpack one file, or the files matching a wildcard pattern, into\n");
+	fprintf(stderr, "	output_dir (default: .), or write them to stdout with -\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	goprom --check romfs_section\n");
+	fprintf(stderr, "	Check that every inode is valid and that no two files overlap,\n");
+	fprintf(stderr, "	and report unused space\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	goprom --build input_dir romfs_section\n");
+	fprintf(stderr, "	Pack the files under input_dir into a new romfs section\n");
+	fprintf(stderr, "\n");
 	fprintf(stderr, "	goprom --update romfs_section > update-romfs.sh\n");
 	fprintf(stderr, "	Generate shell script to update files in an existing romfs section\n");
 	fprintf(stderr, "	DO NOT DO THIS UNLESS YOU *REALLY* KNOW WHAT YOU ARE DOING.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "	Any of these may be combined with --stats to print timings,\n");
+	fprintf(stderr, "	throughput and peak memory use when done.\n");
 }
 
 int main(int argc, char **argv)
 {
-	int		i, nfiles, update = 0;
-	struct inode	d;
+	int		i, nfiles, update = 0, extract = 0, list = 0, check = 0, ret = 0;
+	struct inode	*inodes;
 	FILE		*fd;
+	const char	*outdir = ".", *pattern = NULL, *store_dir = NULL;
+	unsigned long long total = 0;
+	struct store	*store = NULL;
+
+	stats_init(&argc, argv);
+
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "--store") == 0) {
+			store_dir = argv[i + 1];
+			memmove(&argv[i], &argv[i + 2], (argc - i - 1) * sizeof(*argv));
+			argc -= 2;
+			break;
+		}
+	}
+
+	if (store_dir) {
+		if (argc < 2 || strcmp(argv[1], "--extract-all") != 0) {
+			fprintf(stderr, "--store can only be used with --extract-all\n\n");
+			print_usage();
+			exit(-1);
+		}
+
+		store = store_open(store_dir);
+		if (!store)
+			exit(-1);
+	}
+
+	if (argc == 4 && strcmp(argv[1], "--build") == 0)
+		return build_romfs(argv[2], argv[3]);
+
+	if (argc == 4 && strcmp(argv[1], "--extract-all") == 0) {
+		outdir = argv[3];
+		argc--;
+	}
+
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "--extract") == 0) {
+		pattern = argv[3];
+		if (argc == 5)
+			outdir = argv[4];
+		argc = 3;
+	}
 
 	if (argc != 3) {
 		print_usage();
 		exit(-1);
 	}
 
-	if (strcmp(argv[1], "--unpack") == 0) {
+	if (strcmp(argv[1], "--extract-all") == 0) {
+		fprintf(stderr, "Extracting into %s\n", outdir);
+		extract = 1;
+	} else if (pattern) {
+		extract = 1;
+	} else if (strcmp(argv[1], "--list") == 0) {
+		list = 1;
+	} else if (strcmp(argv[1], "--check") == 0) {
+		check = 1;
+	} else if (strcmp(argv[1], "--unpack") == 0) {
 		fprintf(stderr, "Generating unpack script\n");
 		update = 0;
 	} else if (strcmp(argv[1], "--update") == 0) {
@@ -94,27 +1107,51 @@ int main(int argc, char **argv)
 		fprintf(stderr, "... and that certainly does not seem right\n");
 		exit(-1);
 	}
-	
-	fseek(fd, 0x800, SEEK_SET);
-	
-	for (i = 0; i < nfiles; i++) {
-		fread(&d, sizeof(struct inode), 1, fd);
 
-		if (d.magic != INODE_MAGIC) {
-			fprintf(stderr, "Unknown inode magic: %08x\n", d.magic);
-			exit(-1);
-		}
+	if (check) {
+		stats_begin("check");
+		ret = check_romfs(fd, nfiles);
+		stats_end("check", (unsigned long long) nfiles * sizeof(struct inode));
+		fclose(fd);
+		return ret;
+	}
+
+	stats_begin("read");
+	inodes = read_inodes(fd, nfiles);
+	if (!inodes)
+		exit(-1);
+	stats_end("read", (unsigned long long) nfiles * sizeof(struct inode));
 
-		if (!update) {
-			printf("mkdir -p `dirname %s`\n", d.name);
-			printf("dd if=$1 bs=%d skip=1 | dd iflag=fullblock of=%s bs=%d count=1\n",
-				d.offset, d.name, d.len);
-		} else
-			printf("dd if=%s of=$1 bs=1 seek=%d count=%d conv=notrunc\n",
-				d.name, d.offset, d.len);
+	if (pattern) {
+		stats_begin("extract");
+		ret = extract_files(fd, inodes, nfiles, pattern, outdir);
+		stats_end("extract", 0);
+	} else if (extract) {
+		for (i = 0; i < nfiles; i++)
+			total += inodes[i].len;
+
+		stats_begin("extract");
+		ret = extract_all(fd, inodes, nfiles, outdir, store, argv[2]);
+		stats_end("extract", total);
+		store_close(store);
+	} else if (list) {
+		list_files(inodes, nfiles);
+	} else {
+		for (i = 0; i < nfiles; i++) {
+			struct inode *d = &inodes[i];
+
+			if (!update) {
+				printf("mkdir -p `dirname %s`\n", d->name);
+				printf("dd if=$1 bs=%d skip=1 | dd iflag=fullblock of=%s bs=%d count=1\n",
+					d->offset, d->name, d->len);
+			} else
+				printf("dd if=%s of=$1 bs=1 seek=%d count=%d conv=notrunc\n",
+					d->name, d->offset, d->len);
+		}
 	}
 
+	free(inodes);
 	fclose(fd);
 
-	return 0;
+	return ret;
 }
@@ -18,12 +18,15 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <unistd.h>
 
 #include "crc32.h"
+#include "fileio.h"
 
 #define SIZE_OFFSET 0x3f8
 #define CRC_OFFSET 0x3fc
@@ -64,6 +67,7 @@ struct wifi_fw_type {
 	unsigned int crc;
 	unsigned char old_val;
 	int *patch;
+	struct wifi_fw_type *next;	/* hash chain */
 };
 
 struct wifi_fw_type wifi_fw_list[] = {
@@ -91,8 +95,182 @@ struct wifi_fw_type wifi_fw_list[] = {
 	{ },	/* End of list */
 };
 
-static int read_file(FILE *fd, unsigned char *buf, int size);
-static int read_file(FILE *fd, unsigned char *buf, int size)
+/*
+ * Known firmwares, the built-in ones plus any loaded with --registry,
+ * hashed on their size. An unknown file can then usually be turned away
+ * on its size alone, and only a file of a known size gets CRC'd; the
+ * (size, CRC) pair picks the entry.
+ */
+#define FW_HASH_BITS	8
+#define FW_HASH_SIZE	(1 << FW_HASH_BITS)
+
+static struct wifi_fw_type *fw_hash[FW_HASH_SIZE];
+static struct wifi_fw_type **fw_all;	/* in the order they were added */
+static int fw_count, fw_max;
+
+static unsigned int fw_hash_size(unsigned int size);
+static unsigned int fw_hash_size(unsigned int size)
+{
+	return (size * 2654435761U) >> (32 - FW_HASH_BITS);
+}
+
+static struct wifi_fw_type *fw_lookup(unsigned int size, unsigned int crc, int any_crc);
+static struct wifi_fw_type *fw_lookup(unsigned int size, unsigned int crc, int any_crc)
+{
+	struct wifi_fw_type *fw;
+
+	for (fw = fw_hash[fw_hash_size(size)]; fw; fw = fw->next)
+		if (fw->size == size && (any_crc || fw->crc == crc))
+			return fw;
+
+	return NULL;
+}
+
+static int fw_add(struct wifi_fw_type *fw);
+static int fw_add(struct wifi_fw_type *fw)
+{
+	struct wifi_fw_type **tmp, *old;
+	unsigned int h;
+
+	old = fw_lookup(fw->size, fw->crc, 0);
+	if (old) {
+		printf("\"%s\" has the same size and CRC as \"%s\"; ignoring it\n",
+		       fw->name, old->name);
+		return -1;
+	}
+
+	if (fw_count == fw_max) {
+		fw_max = fw_max ? fw_max * 2 : 64;
+		tmp = realloc(fw_all, fw_max * sizeof(*fw_all));
+		if (!tmp) {
+			printf("Could not allocate firmware registry\n");
+			return -1;
+		}
+		fw_all = tmp;
+	}
+	fw_all[fw_count++] = fw;
+
+	h = fw_hash_size(fw->size);
+	fw->next = fw_hash[h];
+	fw_hash[h] = fw;
+	return 0;
+}
+
+/*
+ * Parse one registry line:
+ *	size crc old_val offset,offset,... name of the firmware
+ * Numbers may be given in decimal or 0x-prefixed hex. The CRC is the one
+ * stored in the header of the unpatched firmware.
+ */
+static struct wifi_fw_type *parse_registry_line(char *line);
+static struct wifi_fw_type *parse_registry_line(char *line)
+{
+	struct wifi_fw_type *fw;
+	unsigned long size, crc, old_val;
+	char *p = line, *end;
+	int *patch = NULL, *tmp;
+	int num = 0, max = 0;
+	long offset;
+
+	size = strtoul(p, &end, 0);
+	if (end == p)
+		return NULL;
+	crc = strtoul(p = end, &end, 0);
+	if (end == p)
+		return NULL;
+	old_val = strtoul(p = end, &end, 0);
+	if (end == p || old_val > 255)
+		return NULL;
+
+	do {
+		p = num ? end + 1 : end;	/* skip the comma */
+		offset = strtol(p, &end, 0);
+		if (end == p || offset < 0 || (unsigned long) offset >= size ||
+		    (offset >= SIZE_OFFSET && offset < CRC_OFFSET + 4))
+			goto fail;
+
+		/* Leave room for the -1 terminator */
+		if (num + 1 >= max) {
+			max = max ? max * 2 : 8;
+			tmp = realloc(patch, max * sizeof(*patch));
+			if (!tmp)
+				goto fail;
+			patch = tmp;
+		}
+		patch[num++] = offset;
+	} while (*end == ',');
+	patch[num] = -1;
+
+	while (*end == ' ' || *end == '\t')
+		end++;
+	end[strcspn(end, "\r\n")] = '\0';
+	if (!*end || size < CRC_OFFSET + 4)
+		goto fail;
+
+	fw = calloc(1, sizeof(*fw));
+	if (!fw)
+		goto fail;
+
+	fw->name = strdup(end);
+	fw->size = size;
+	fw->crc = crc;
+	fw->old_val = old_val;
+	fw->patch = patch;
+	return fw;
+
+fail:
+	free(patch);
+	return NULL;
+}
+
+static int load_registry(const char *fname);
+static int load_registry(const char *fname)
+{
+	struct wifi_fw_type *fw;
+	char line[1024];
+	int lineno = 0, added = 0;
+	FILE *fd;
+
+	fd = fopen(fname, "r");
+	if (!fd) {
+		printf("Could not open firmware registry %s\n", fname);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fd)) {
+		lineno++;
+		line[strcspn(line, "#")] = '\0';
+		if (strspn(line, " \t\r\n") == strlen(line))
+			continue;
+
+		fw = parse_registry_line(line);
+		if (!fw) {
+			printf("%s:%d: bad firmware registry entry\n", fname, lineno);
+			fclose(fd);
+			return -1;
+		}
+
+		if (fw_add(fw) == 0)
+			added++;
+	}
+
+	fclose(fd);
+	printf("Loaded %d firmware types from %s\n", added, fname);
+	return 0;
+}
+
+static void print_known_firmwares(void);
+static void print_known_firmwares(void)
+{
+	int i;
+
+	printf("This only works on the following firmware files:\n");
+	for (i = 0; i < fw_count; i++)
+		printf("\t * %s\n", fw_all[i]->name);
+}
+
+static int read_file(FILE *fd, unsigned char *buf, size_t size);
+static int read_file(FILE *fd, unsigned char *buf, size_t size)
 {
 	int ret;
 	ret = fread(buf, size, 1, fd);
@@ -138,44 +316,310 @@ static int patch_buffer(unsigned char *buf, int *offsets, unsigned char val, uns
 	return 0;
 }
 
-static int save_file(const char *output_name, int size, unsigned char *buf);
-static int save_file(const char *output_name, int size, unsigned char *buf)
+/*
+ * Write the output as a clone of the input firmware, so that only the
+ * patched bytes and the CRC word have to be written.
+ */
+static int save_patched(const char *fname, const char *output_name, unsigned char *buf, int *offsets);
+static int save_patched(const char *fname, const char *output_name, unsigned char *buf, int *offsets)
 {
-	FILE *ofd;
-	int ret;
-	ofd = fopen(output_name, "wb+");
-	if (!ofd) {
-		printf("Could not write to %s\n", output_name);
+	int fd, created, i, ret;
+
+	fd = clone_file(fname, output_name, &created);
+	if (fd < 0)
 		return -1;
+
+	ret = pwrite_all(fd, buf + CRC_OFFSET, 4, CRC_OFFSET);
+	for (i = 0; offsets[i] != -1 && !ret; i++)
+		ret = pwrite_all(fd, buf + offsets[i], 1, offsets[i]);
+
+	if (close(fd))
+		ret = -1;
+
+	/* Patching in place, the output is the original image; never remove that */
+	if (ret && created)
+		unlink(output_name);
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * Read a wifi firmware into memory and check its header. If precheck is
+ * set, files whose size matches no known firmware are rejected before
+ * being read. On success the CRC word in the returned buffer is zeroed,
+ * ready for patching, and *crc holds the CRC from the header.
+ */
+static unsigned char *read_wifi_fw(const char *fname, unsigned int *out_size, uint32_t *crc, int precheck);
+static unsigned char *read_wifi_fw(const char *fname, unsigned int *out_size, uint32_t *crc, int precheck)
+{
+	FILE *in_fd;
+	struct stat st;
+	unsigned int size, hdr_size;
+	unsigned char *buf;
+	uint32_t hdr_crc;
+	int ret;
+
+	ret = stat(fname, &st);
+	if (ret) {
+		printf("Error: Could not stat %s\n", fname);
+		return NULL;
 	}
-	ret = fwrite(buf, size, 1, ofd);
-	fclose(ofd);
 
-	return ret == 1 ? 0 : -1;
+	/* The header holds a 32-bit size; don't let a huge file wrap around */
+	size = st.st_size;
+	if (size < CRC_OFFSET + 4 || (off_t) size != st.st_size) {
+		printf("Bad file size: %lld\n", (long long) st.st_size);
+		return NULL;
+	}
+
+	if (precheck && !fw_lookup(size, 0, 1)) {
+		printf("\nUnrecognized firmware file! No known firmware is %d bytes long.\n", size);
+		print_known_firmwares();
+		return NULL;
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		printf("Could not allocate %d bytes\n", size);
+		return NULL;
+	}
+
+	in_fd = fopen(fname, "rb");
+	if (!in_fd) {
+		printf("Could not open %s\n", fname);
+		goto fail;
+	}
+
+	ret = read_file(in_fd, buf, size);
+	fclose(in_fd);
+	if (ret) {
+		printf("Could not read file: %d\n", ret);
+		goto fail;
+	}
+
+	hdr_size = read_word(buf, SIZE_OFFSET);
+	hdr_crc = read_word(buf, CRC_OFFSET);
+
+	printf("Wifi FW header reports size: %08x\n", hdr_size);
+	printf("Wifi FW header reports CRC : %08x\n", hdr_crc);
+
+	printf("Actual file size: %08x\n", size);
+	if (size != hdr_size) {
+		printf("File size does not match size reported in header.\n");
+		goto fail;
+	}
+
+	write_word(buf, CRC_OFFSET, 0x00000000);
+	*crc = crc32(buf, size);
+
+	printf("Actual file CRC : %08x\n", *crc);
+	if (*crc != hdr_crc) {
+		printf("File CRC does not match CRC reported in header.\n");
+		goto fail;
+	}
+
+	*out_size = size;
+	return buf;
+
+fail:
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Patch site relocation. Every patch site of a known reference firmware
+ * is described by two signatures: the SIG_LEN bytes ending at the site,
+ * and the SIG_LEN bytes starting at it. All of them are searched for in
+ * the new firmware in a single pass, with a hash of their first four
+ * bytes (and a bitmap of those hashes) as the prefilter. A site is taken
+ * where a signature matches exactly once and the other one either agrees
+ * or does not match at all, so code that moved or changed on one side of
+ * a site can still be followed.
+ */
+#define SIG_LEN		24
+#define SIG_HASH_BITS	12
+#define SIG_HASH_SIZE	(1 << SIG_HASH_BITS)
+
+struct signature {
+	const unsigned char *bytes;
+	int site_pos;			/* offset of the site within the signature */
+	int matches;
+	long match;			/* site offset in the new firmware */
+	struct signature *next;		/* hash chain */
+};
+
+static unsigned int sig_hash(const unsigned char *p);
+static unsigned int sig_hash(const unsigned char *p)
+{
+	uint32_t w = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+
+	return (w * 2654435761U) >> (32 - SIG_HASH_BITS);
+}
+
+static void find_signatures(const unsigned char *buf, unsigned int size,
+			    struct signature **table, const unsigned char *bitmap);
+static void find_signatures(const unsigned char *buf, unsigned int size,
+			    struct signature **table, const unsigned char *bitmap)
+{
+	struct signature *sig;
+	unsigned int pos, h;
+
+	for (pos = 0; pos + SIG_LEN <= size; pos++) {
+		h = sig_hash(buf + pos);
+		if (!(bitmap[h >> 3] & (1 << (h & 7))))
+			continue;
+
+		for (sig = table[h]; sig; sig = sig->next) {
+			if (memcmp(buf + pos, sig->bytes, SIG_LEN))
+				continue;
+			if (!sig->matches++)
+				sig->match = pos + sig->site_pos;
+		}
+	}
+}
+
+/* Pick the new location of a site from its two signatures, or -1 */
+static long resolve_site(const struct signature *before, const struct signature *after);
+static long resolve_site(const struct signature *before, const struct signature *after)
+{
+	if (before->matches == 1 && after->matches == 1)
+		return before->match == after->match ? before->match : -1;
+
+	if (before->matches == 1 && after->matches == 0)
+		return before->match;
+
+	if (after->matches == 1 && before->matches == 0)
+		return after->match;
+
+	return -1;
+}
+
+static int relocate(const char *ref_name, const char *new_name, const char *label);
+static int relocate(const char *ref_name, const char *new_name, const char *label)
+{
+	struct signature *table[SIG_HASH_SIZE], *sigs = NULL, *sig;
+	unsigned char bitmap[SIG_HASH_SIZE / 8];
+	unsigned char *ref = NULL, *buf = NULL;
+	unsigned int ref_size, size, h;
+	uint32_t ref_crc, crc;
+	struct wifi_fw_type *ref_fw;
+	int num_sites, i, ret = -1;
+	long site;
+
+	printf("Reading reference firmware %s\n", ref_name);
+	ref = read_wifi_fw(ref_name, &ref_size, &ref_crc, 1);
+	if (!ref)
+		goto out;
+
+	ref_fw = fw_lookup(ref_size, ref_crc, 0);
+	if (!ref_fw) {
+		printf("\nThe reference firmware must be a known one.\n");
+		print_known_firmwares();
+		goto out;
+	}
+	printf("Reference firmware type: \"%s\"\n\n", ref_fw->name);
+
+	printf("Reading new firmware %s\n", new_name);
+	buf = read_wifi_fw(new_name, &size, &crc, 0);
+	if (!buf)
+		goto out;
+
+	if (fw_lookup(size, crc, 0))
+		printf("Note: this is already known as \"%s\"\n", fw_lookup(size, crc, 0)->name);
+
+	for (num_sites = 0; ref_fw->patch[num_sites] != -1; num_sites++)
+		;
+
+	sigs = calloc(num_sites * 2, sizeof(*sigs));
+	if (!sigs) {
+		printf("Could not allocate signatures\n");
+		goto out;
+	}
+
+	memset(table, 0, sizeof(table));
+	memset(bitmap, 0, sizeof(bitmap));
+
+	for (i = 0; i < num_sites * 2; i++) {
+		site = ref_fw->patch[i / 2];
+		sig = &sigs[i];
+
+		/* Even entries end at the site, odd ones start at it */
+		sig->site_pos = (i & 1) ? 0 : SIG_LEN - 1;
+		if (site - sig->site_pos < 0 || site - sig->site_pos + SIG_LEN > (long) ref_size)
+			continue;	/* runs off the file; never matches */
+
+		sig->bytes = ref + site - sig->site_pos;
+		h = sig_hash(sig->bytes);
+		sig->next = table[h];
+		table[h] = sig;
+		bitmap[h >> 3] |= 1 << (h & 7);
+	}
+
+	find_signatures(buf, size, table, bitmap);
+
+	printf("\nRelocating %d patch sites:\n", num_sites);
+	ret = 0;
+	for (i = 0; i < num_sites; i++) {
+		site = resolve_site(&sigs[i * 2], &sigs[i * 2 + 1]);
+
+		printf("\t%08x -> ", ref_fw->patch[i]);
+		if (site < 0) {
+			printf("not found (%d/%d signature matches)\n",
+			       sigs[i * 2].matches, sigs[i * 2 + 1].matches);
+			ret = -1;
+		} else if (buf[site] != ref_fw->old_val) {
+			printf("%08lx, but holds %02x instead of %02x\n", site, buf[site], ref_fw->old_val);
+			ret = -1;
+		} else {
+			printf("%08lx\n", site);
+			sigs[i * 2].match = site;
+		}
+	}
+
+	if (ret) {
+		printf("\nCould not relocate every patch site. No registry entry was made.\n");
+		goto out;
+	}
+
+	printf("\nRegistry entry for --registry:\n");
+	printf("0x%08x 0x%08x %d ", size, crc, ref_fw->old_val);
+	for (i = 0; i < num_sites; i++)
+		printf("%s0x%lx", i ? "," : "", sigs[i * 2].match);
+	printf(" %s\n", label);
+
+out:
+	free(sigs);
+	free(buf);
+	free(ref);
+	return ret;
 }
 
 static void print_usage(const char *name);
 static void print_usage(const char *name)
 {
-	printf("Usage: %s [firmware file] [address digit] [output filename]\n", name);
+	printf("Usage: %s [--registry file]... [firmware file] [address digit] [output filename]\n", name);
 
 	printf("Patch Gopro Wifi Firmware with custom IP address\n");
 	printf("New camera address will be 10.X.5.9\n");
 	printf("New computer address will be 10.X.5.109\n");
 	printf("Where X is the address digit specified\n");
+	printf("\n--registry adds the firmware types listed in a file, one per line as:\n");
+	printf("\tsize crc old_val offset,offset,... name\n");
+	printf("\nUsage: %s [--registry file]... --relocate reference_firmware new_firmware [name]\n", name);
+	printf("Find the patch sites of a known reference firmware in a new firmware build,\n");
+	printf("and print a registry entry for it\n");
 }
 
 int main(int argc, char **argv)
 {
-	FILE *in_fd;
 	char *fname, *output_name;
-	struct stat st;
 	int ret;
-	unsigned int size, hdr_size;
+	unsigned int size;
 	unsigned char *buf;
-	uint32_t crc, hdr_crc;
+	uint32_t crc;
 	int patch_byte = 8;
-	struct wifi_fw_type *wifi_fw = wifi_fw_list;
+	struct wifi_fw_type *wifi_fw;
+	int i;
 
 	printf("MAKE SURE YOU HAVE READ THE INSTRUCTIONS!\n");
 	printf("The author makes absolutely NO GUARANTEES of the correctness of this program\n");
@@ -186,6 +630,20 @@ int main(int argc, char **argv)
 	printf("of using this program. Use it at your own risk! You have been warned.\n");
 	printf("\n");
 
+	for (i = 0; wifi_fw_list[i].name; i++)
+		fw_add(&wifi_fw_list[i]);
+
+	while (argc > 2 && strcmp(argv[1], "--registry") == 0) {
+		if (load_registry(argv[2]))
+			return -1;
+		argv[2] = argv[0];
+		argc -= 2;
+		argv += 2;
+	}
+
+	if ((argc == 4 || argc == 5) && strcmp(argv[1], "--relocate") == 0)
+		return relocate(argv[2], argv[3], argc == 5 ? argv[4] : argv[3]);
+
 	if (argc != 4) {
 		print_usage(argv[0]);
 		return -1;
@@ -206,74 +664,18 @@ int main(int argc, char **argv)
 
 	output_name = argv[3];
 
-	ret = stat(fname, &st);
-	if (ret) {
-		printf("Error: Could not stat %s\n", fname);
-		return -1;
-	}
-
-	size = st.st_size;
-	if (size <= 0) {
-		printf("Bad file size: %d\n", size);
-		return -1;
-	}
-
-	buf = malloc(size);
-	if (!buf) {
-		printf("Could not allocate %d bytes\n", size);
-		return -1;
-	}
-
-	in_fd = fopen(fname, "rb");
-
-	ret = read_file(in_fd, buf, size);
-	if (ret) {
-		printf("Could not read file: %d\n", ret);
+	buf = read_wifi_fw(fname, &size, &crc, 1);
+	if (!buf)
 		return -1;
-	}
-	fclose(in_fd);
-
-	hdr_size = read_word(buf, SIZE_OFFSET);
-	hdr_crc = read_word(buf, CRC_OFFSET);
-
-	printf("Wifi FW header reports size: %08x\n", hdr_size);
-	printf("Wifi FW header reports CRC : %08x\n", hdr_crc);
-
-	printf("Actual file size: %08x\n", size);
-	if (size != hdr_size) {
-		printf("File size does not match size reported in header.\n");
-		goto fail;
-	}
-
-	write_word(buf, CRC_OFFSET, 0x00000000);
-	crc = crc32(buf, size);
-
-	printf("Actual file CRC : %08x\n", crc);
-	if (crc != hdr_crc) {
-		printf("File CRC does not match CRC reported in header.\n");
-		goto fail;
-	}
 
 	/*
 	 * Checking both the size and CRC is probably redundant, but we may
 	 * as well be careful
 	 */
-	while (wifi_fw->name) {
-		if (wifi_fw->size == size && wifi_fw->crc == crc)
-			break;
-		wifi_fw++;
-	}
-
-	if (wifi_fw->name == NULL) {
+	wifi_fw = fw_lookup(size, crc, 0);
+	if (!wifi_fw) {
 		printf("\nUnrecognized firmware file!\n");
-		printf("This only works on the following firmware files:\n");
-
-		wifi_fw = wifi_fw_list;
-		while (wifi_fw->name) {
-			printf("\t * %s\n", wifi_fw->name);
-			wifi_fw++;
-		}
-
+		print_known_firmwares();
 		goto fail;
 	}
 
@@ -291,7 +693,7 @@ int main(int argc, char **argv)
 	write_word(buf, CRC_OFFSET, crc);
 
 	printf("Saving output file: %s\n", output_name);
-	ret = save_file(output_name, size, buf);
+	ret = save_patched(fname, output_name, buf, wifi_fw->patch);
 	if (ret) {
 		printf("Error saving file: %d\n", ret);
 		goto fail;
@@ -22,293 +22,56 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <inttypes.h>
 
 #include "crc32.h"
+#include "fileio.h"
+#include "fwindex.h"
+#include "secpatch.h"
+#include "stats.h"
 
 #define GLOBAL_HEADER_SIZE	224
 
-unsigned char *read_file(const char *fname, unsigned int *out_size);
-unsigned char *read_file(const char *fname, unsigned int *out_size)
-{
-	unsigned char *buf;
-	struct stat st;
-	int size, ret;
-	FILE *fd;
-
-	ret = stat(fname, &st);
-	if (ret) {
-		printf("Error: Could not stat %s\n", fname);
-		return NULL;
-	}
-
-	size = st.st_size;
-	if (size <= 0) {
-		printf("Bad file size of %s: %d\n", fname, size);
-		return NULL;
-	}
-
-	fd = fopen(fname, "rb");
-	if (!fd) {
-		printf("Error opening file %s\n", fname);
-		return NULL;
-	}
-		
-	buf = malloc(size);
-	if (!buf) {
-		printf("Could not allocate %d bytes\n", size);
-		fclose(fd);
-		return NULL;
-	}
-
-	ret = fread(buf, size, 1, fd);
-	
-	if (ret != 1) {
-		printf("Error reading file %s: %d\n", fname, ret);
-		free(buf);
-		fclose(fd);
-		return NULL;
-	}
-
-	*out_size = size;
-	fclose(fd);
-	
-	return buf;
-}
-
-/*
- * FW header appears to be big-endian ?
- */
-static uint32_t read_word_le(unsigned char *buf, int offset);
-static uint32_t read_word_le(unsigned char *buf, int offset)
-{
-	return (buf[offset+0] << 0) |
-	       (buf[offset+1] << 8) |
-	       (buf[offset+2] << 16) |
-	       (buf[offset+3] << 24);
-}
-
-static void write_word_le(unsigned char *buf, int offset, uint32_t word);
-static void write_word_le(unsigned char *buf, int offset, uint32_t word)
-{
-	buf[offset+0] = word >> 0;
-	buf[offset+1] = word >> 8;
-	buf[offset+2] = word >> 16;
-	buf[offset+3] = word >> 24;
-}
-
-static int save_file(const char *output_name, int size, unsigned char *buf);
-static int save_file(const char *output_name, int size, unsigned char *buf)
-{
-	FILE *ofd;
-	int ret;
-	ofd = fopen(output_name, "wb+");
-	if (!ofd) {
-		printf("Could not write to %s\n", output_name);
-		return -1;
-	}
-	ret = fwrite(buf, size, 1, ofd);
-	fclose(ofd);
-
-	return ret == 1 ? 0 : -1;
-}
+static const struct fw_layout h4_layout = {
+	.crc_start = GLOBAL_HEADER_SIZE,
+	.crc_trim = 0,
+	.crc_at_end = 0,
+	.crc_big_endian = 0,
+	.index_flags = INDEX_VERIFIED_H4,
+};
 
 static void print_usage(const char *name);
 static void print_usage(const char *name)
 {
-	printf("Usage: %s unpatched_firmware.bin section_filename section_number output_firmware.bin\n\n", name);
+	printf("Usage: %s [--revalidate] [--stream] [--stats] unpatched_firmware.bin section_filename section_number\n", name);
+	printf("       [section_filename section_number ...] output_firmware.bin\n\n");
 	printf("unpatched_firmware.bin - original, unpatched camera_firmware.bin file\n");
 	printf("section_filename       - filename of replacement section being packed into the firmware\n");
 	printf("section_number         - number of section to replace\n");
 	printf("output_firmware.bin    - filename for where to write the modified camera_firmware.bin file\n");
+	printf("\nAny number of section_filename section_number pairs may be given; all of them\n");
+	printf("are applied in a single pass over the firmware.\n");
+	printf("\n--stream copies the firmware through a small buffer instead of loading all of\n");
+	printf("it into memory, for very large images or many jobs running in parallel.\n");
+	printf("--stats prints timings, throughput and peak memory use when done.\n");
 }
 
-static int find_magic(unsigned char *buf, int size, int start_offset);
-static int find_magic(unsigned char *buf, int size, int start_offset)
-{
-	int c;
-	int state = 0;
-	int offset = start_offset;
-	
-	while (offset < size) {
-		c = buf[offset++];
-		if (c < 0)
-			return -1;
-
-		switch (state) {
-			case 0:
-				if (c == 0x90)
-					state = 1;
-				else
-					state = 0;
-
-				break;
-			case 1:
-				if (c == 0xEB)
-					state = 2;
-				else
-					state = 0;
-
-				break;
-
-			case 2:
-				if (c == 0x24)
-					state = 3;
-				else
-					state = 0;
-				break;
-
-			case 3:
-				if (c == 0xA3) {
-					return offset;
-
-				} else
-					state = 0;
-				break;
-
-			default:
-				fprintf(stderr, "Unexpected state %u in find_magic", state);
-				return -1;
-		}
-
-		if (c == 0x90)
-			state = 1;
-	}
-
-	return -1;
-}
-
-struct section_info {
-	unsigned int header_crc;
-	unsigned int actual_crc;
-	unsigned int version;
-	unsigned int build_date;
-	unsigned int flags;
-	unsigned int magic;
-	unsigned int offset;
-	unsigned int length;
-};
-
-void print_sections(struct section_info *sections, int num_sections);
-void print_sections(struct section_info *sections, int num_sections)
-{
-	int i;
-	printf("Section\t\t  Offset\t  Length\t     CRC\n");
-	printf("========================================================\n");
-	for (i = 0; i < num_sections; i++) {
-		printf("section_%d\t%8d\t%8d\t%08x (%s)\n",
-		       i, sections[i].offset, sections[i].length, sections[i].header_crc,
-			(sections[i].header_crc == sections[i].actual_crc) ? "OK" : "MISMATCH!"
-		);
-	}
-}
-
-unsigned int get_global_crc(unsigned char *buf, int size);
-unsigned int get_global_crc(unsigned char *buf, int size)
-{
-	if (size < GLOBAL_HEADER_SIZE) {
-		printf("Invalid firmware size: %d\n", size);
-		return 0;
-	}
-	
-	return crc32(buf + GLOBAL_HEADER_SIZE, size - GLOBAL_HEADER_SIZE);
-}
-
-int parse_firmware(unsigned char *buf, int size, struct section_info *output, unsigned int max_sections);
-int parse_firmware(unsigned char *buf, int size, struct section_info *output, unsigned int max_sections)
-{
-	unsigned int section_offset, num = 0;
-	unsigned int global_header_crc, global_actual_crc;
-	int length;
-	int offset = 0;
-	
-	if (size < GLOBAL_HEADER_SIZE) {
-		printf("Invalid firmware size: %d\n", size);
-		return -1;
-	}
-	
-	global_header_crc = read_word_le(buf, 0);
-	global_actual_crc = get_global_crc(buf, size);
-	
-	printf("Global header CRC: %08x\n", global_header_crc);
-	printf("Global actual CRC: %08x (%s)\n", global_actual_crc,
-		(global_header_crc == global_actual_crc) ? "OK" : "MISMATCH!");
-	
-	if (global_header_crc != global_actual_crc) {
-		printf("DANGER!!! Firmware global CRC does not match the CRC listed in the header!\n");
-		printf("This is a bad thing. This firmware looks invalid.\n");
-		return -1;
-	}
-	
-	while (1) {
-		if (num >= max_sections) {
-			printf("Firmware contains more than %d sections. Something must be wrong.\n", max_sections);
-			return -1;
-		}
-		
-		offset = find_magic(buf, size, offset);
-		if (offset < 0) {
-			return num;
-		}
-	
-		offset -= 28;
-		output[num].header_crc = read_word_le(buf, offset);
-		offset += 4;
-
-		output[num].version = read_word_le(buf, offset);
-		offset += 4;
-
-		output[num].build_date = read_word_le(buf, offset);
-		offset += 4;
-		
-		length = read_word_le(buf, offset);
-		offset += 4;
-		offset += 4;
-
-		output[num].flags = read_word_le(buf, offset);
-		offset += 4;
-
-		output[num].magic = read_word_le(buf, offset);
-		offset += 4;
-
-		offset += 0x100 - 28;
-
-		section_offset = offset;
-
-		output[num].length = length;
-		output[num].offset = section_offset;
-		
-		if (length < 0)
-			continue;
-
-		output[num].actual_crc = crc32(buf + section_offset, length);
-
-		if (output[num].header_crc != output[num].actual_crc) {
-			printf("WARNING!!! CRC MISMATCH WHILE PARSING SECTION %d\n", num);
-			printf("Header CRC = %08x, Actual CRC = %08x\n",
-			       output[num].header_crc, output[num].actual_crc);
-			return -1;
-		}
-		
-		offset += length;
-		
-		num++;
-	}
-}
-
-#define MAX_SECTIONS	100
-
 int main(int argc, char **argv)
 {
-	char *fname, *sname, *oname;
+	char *fname, *oname;
 	int ret;
 	int target_section;
-	unsigned char *fw_buf, *replacement_buf;
-	unsigned int fw_size, replacement_size;
+	unsigned char *fw_buf;
+	size_t fw_size;
+	size_t fw_map_size;
 	int num_sections;
 	int old_num_sections;
-	unsigned int new_section_crc, new_global_crc;
-	struct section_info sections[MAX_SECTIONS];
+	unsigned int new_section_crc, global_crc;
+	struct section_info *sections, *new_sections;
+	struct replacement *replacements, *r;
+	int num_replacements;
+	int stream;
+	unsigned long long patched = 0;
+	int i, j;
 	
 	printf("evilwombat's magical firmware section patching tool.\n");
 	printf("This program is incomplete, undocumented, and unfit for any purpose whatsoever.\n");
@@ -329,35 +92,71 @@ int main(int argc, char **argv)
 	printf("\nMoreover, this program is INCOMPLETE and probably nonfunctional.\n");
 	printf("DO NOT USE THIS PROGRAM!\n\n");
 	
-	if (argc != 5) {
+	index_options(&argc, argv);
+	stats_init(&argc, argv);
+	stream = stream_option(&argc, argv);
+
+	if (argc < 5 || (argc - 3) % 2) {
 		print_usage(argv[0]);
 		return -1;
 	}
 	
 	fname = argv[1];
-	sname = argv[2];
-	target_section = atoi(argv[3]);
-	oname = argv[4];
+	oname = argv[argc - 1];
+	num_replacements = (argc - 3) / 2;
+
+	replacements = calloc(num_replacements, sizeof(*replacements));
+	if (!replacements) {
+		printf("Could not allocate %d replacements\n", num_replacements);
+		return -1;
+	}
 
-	printf("Replacing section %d in file %s with file %s, and writing output to %s\n",
-	       target_section, fname, sname, oname);
+	for (i = 0; i < num_replacements; i++) {
+		r = &replacements[i];
+		r->fname = argv[2 + i * 2];
+		r->section = atoi(argv[3 + i * 2]);
 
-	fw_buf = read_file(fname, &fw_size);
+		printf("Replacing section %d in file %s with file %s\n", r->section, fname, r->fname);
+
+		for (j = 0; j < i; j++) {
+			if (replacements[j].section == r->section) {
+				printf("Section %d is being replaced more than once. Exiting.\n", r->section);
+				return -1;
+			}
+		}
+	}
+	printf("Writing output to %s\n", oname);
+
+	if (stream) {
+		ret = stream_firmware(&h4_layout, fname, replacements, num_replacements, oname);
+		free(replacements);
+		return ret;
+	}
+
+	/* The firmware is patched in place; writes only touch a private copy */
+	fw_buf = map_file(fname, &fw_map_size, 1);
 	
 	if (!fw_buf) {
 		printf("Could not read in original firmware file %s. Exiting.\n", fname);
 		return -1;
 	}
+	fw_size = fw_map_size;
 	
-	replacement_buf = read_file(sname, &replacement_size);
+	for (i = 0; i < num_replacements; i++) {
+		r = &replacements[i];
+		r->buf = map_file(r->fname, &r->map_size, 0);
 	
-	if (!replacement_buf) {
-		printf("Could not read in replacement section file %s. Exiting.\n", sname);
-		return -1;
+		if (!r->buf) {
+			printf("Could not read in replacement section file %s. Exiting.\n", r->fname);
+			return -1;
+		}
+		r->size = r->map_size;
 	}
 
 	printf("\nDecoding contents of %s...\n", fname);
-	num_sections = parse_firmware(fw_buf, fw_size, sections, MAX_SECTIONS);
+	stats_begin("verify");
+	num_sections = load_firmware(&h4_layout, fname, fw_buf, fw_size, &sections);
+	stats_end("verify", fw_size);
 	if (num_sections <= 0) {
 		printf("This firmware looks invalid. Exiting.\n");
 		return -1;
@@ -366,87 +165,97 @@ int main(int argc, char **argv)
 	print_sections(sections, num_sections);
 	printf("\n");
 
-	if (target_section >= num_sections) {
-		printf("This firmware file (%s) only contains %d sections, and you are\n", fname, num_sections);
-		printf("trying to replace section %d (and they are numbered from 0).\n", target_section);
-		printf("Are you sure you know what you are doing?\n");
-		return -1;
-	}
-	
-	printf("Okay. Trying to replace section_%d with %s\n", target_section, sname);
-	
-	if (sections[target_section].length > replacement_size) {
-		printf("\n******************************************************************************\n");
-		printf("WARNING!! The replacement section is smaller than the section in the firmware.\n");
-		printf("In the firmware, section_%d is %d bytes long.\n",
-		       target_section, sections[target_section].length);
-		printf("Your replacement file for section_%d is only %d bytes long.\n",
-		       target_section, replacement_size);
-		printf("Your replacement section is smaller than the target section by %d bytes.\n",
-			sections[target_section].length - replacement_size);
-		printf("\nThis might not necessarily be a bad thing, depending on what you are doing.\n");
-		printf("If you continue, the section will be zero-padded to the expected length.\n");
-		printf("******************************************************************************\n");
-		printf("Would you like to proceed? (y/n)\n");
-		
-		if (getchar() != 'y') {
-			printf("Operation aborted by user\n");
+	/* Check everything before touching anything */
+	for (i = 0; i < num_replacements; i++)
+		if (check_replacement(&replacements[i], sections, num_sections, fname))
 			return -1;
-		}
-	}
-	
-	if (sections[target_section].length < replacement_size) {
-		printf("\n**************************************************************\n");
-		printf("ERROR!! The replacement section will not fit into the firmware.\n");
-		printf("Your replacement file for section_%d has length %d bytes.\n", target_section, replacement_size);
-		printf("In the firmware, this section is only %d bytes long.\n", sections[target_section].length);
-		printf("Your replacement section is too long by %d bytes.\n",
-			replacement_size - sections[target_section].length);
-		printf("This will not work.\n");
-		return -1;
-	}
 
-	printf("\nReplacing target section...\n");
-	/* Zero out replacement section in case we are zero-padding */
-	memset(fw_buf + sections[target_section].offset, 0, sections[target_section].length);
-	memcpy(fw_buf + sections[target_section].offset, replacement_buf, replacement_size);
+	global_crc = read_global_crc(&h4_layout, fw_buf, fw_size);
 
-	printf("Updating CRCs...\n");
-	new_section_crc = crc32(fw_buf + sections[target_section].offset, sections[target_section].length);
-	printf("New section CRC: %08x\n", new_section_crc);
-	
-	write_word_le(fw_buf, sections[target_section].offset - 0x100, new_section_crc);
+	stats_begin("patch");
+	for (i = 0; i < num_replacements; i++) {
+		r = &replacements[i];
+		target_section = r->section;
 
-	new_global_crc = get_global_crc(fw_buf, fw_size);
-	printf("New global CRC: %08x\n", new_global_crc);
+		printf("\nReplacing section_%d...\n", target_section);
+		/* Zero out replacement section in case we are zero-padding */
+		memset(fw_buf + sections[target_section].offset, 0, sections[target_section].length);
+		memcpy(fw_buf + sections[target_section].offset, r->buf, r->size);
+
+		printf("Updating CRCs...\n");
+		new_section_crc = crc32(fw_buf + sections[target_section].offset, sections[target_section].length);
+		printf("New section CRC: %08x\n", new_section_crc);
 	
-	write_word_le(fw_buf, 0, new_global_crc);
+		write_word_le(fw_buf, sections[target_section].offset - 0x100, new_section_crc);
+
+		global_crc = update_global_crc(&h4_layout, fw_buf, fw_size, global_crc,
+					       &sections[target_section], new_section_crc);
+
+		/* From here on, sections[] describes the patched firmware */
+		sections[target_section].header_crc = new_section_crc;
+		sections[target_section].actual_crc = new_section_crc;
+		patched += sections[target_section].length;
+	}
+	stats_end("patch", patched);
+
+	printf("New global CRC: %08x\n", global_crc);
+	write_global_crc(&h4_layout, fw_buf, fw_size, global_crc);
 	
 	old_num_sections = num_sections;
 
+	/*
+	 * The CRCs above were derived rather than recomputed, so only the
+	 * section headers are rescanned here. They must describe the same
+	 * layout as before, with the new CRCs on the replaced sections.
+	 */
 	printf("\nRescanning resulting firmware for sanity...\n");
-	num_sections = parse_firmware(fw_buf, fw_size, sections, MAX_SECTIONS);
+	stats_begin("rescan");
+	num_sections = parse_firmware(&h4_layout, fw_buf, fw_size, &new_sections, 0);
+	stats_end("rescan", fw_size);
 	if (num_sections <= 0) {
 		printf("The new firmware looks invalid!!\nThis is definitely a bug in this program.\n");
 		printf("Please contact evilwombat and report how this happened.\n");
 		return -1;
 	}
 	printf("\nFound %d sections in the new firmware:\n", num_sections);
-	print_sections(sections, num_sections);
+	print_sections(new_sections, num_sections);
 
 	if (num_sections != old_num_sections) {
 		printf("Old and new section count does not match!!\nThis is definitely a bug in this program.\n");
 		printf("Please contact evilwombat and report how this happened.\n");
 		return -1;
 	}
+
+	for (i = 0; i < num_sections; i++) {
+		if (new_sections[i].offset != sections[i].offset ||
+		    new_sections[i].length != sections[i].length ||
+		    new_sections[i].header_crc != sections[i].header_crc) {
+			printf("Section %d header changed unexpectedly!!\nThis is definitely a bug in this program.\n", i);
+			printf("Please contact evilwombat and report how this happened.\n");
+			return -1;
+		}
+	}
 	
 	printf("\nSaving new firmware to file %s...\n", oname);
-	ret = save_file(oname, fw_size, fw_buf);
+	stats_begin("write");
+	ret = save_patched(&h4_layout, fname, oname, fw_buf, fw_size, sections,
+			   replacements, num_replacements);
+	stats_end("write", patched);
 	if (ret) {
 		printf("Error saving file!\n");
 		return -1;
 	}
 	printf("Done.\n");
 
+	/* Save the next tool in the pipeline from having to rescan the output */
+	index_save(oname, 0, new_sections, num_sections);
+
+	for (i = 0; i < num_replacements; i++)
+		unmap_file(replacements[i].buf, replacements[i].map_size);
+	free(replacements);
+	unmap_file(fw_buf, fw_map_size);
+	free(new_sections);
+	free(sections);
+
 	return 0;
 }
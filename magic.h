@@ -0,0 +1,14 @@
+#ifndef MAGIC_H
+#define MAGIC_H 1
+
+#include <stdio.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Section header magic is 0xA3 0x24 0xEB 0x90, stored little-endian */
+#define SECTION_MAGIC_LEN	4
+
+off_t find_magic(const unsigned char *buf, size_t size, size_t start_offset);
+int find_magic_file(FILE *fd);
+
+#endif /* MAGIC_H */
@@ -0,0 +1,651 @@
+/*
+ *  Copyright (c) 2013-2015, evilwombat
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Section replacement shared by h4-section-patch and h3plus-section-patch.
+ * The two layouts only differ in which bytes the global CRC covers and
+ * where and in which byte order it is stored, which struct fw_layout
+ * describes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "fwindex.h"
+#include "secpatch.h"
+#include "stats.h"
+
+/* Section headers are little-endian, whatever the layout */
+uint32_t read_word_le(const unsigned char *buf, size_t offset)
+{
+	return (buf[offset+0] << 0) |
+	       (buf[offset+1] << 8) |
+	       (buf[offset+2] << 16) |
+	       ((uint32_t) buf[offset+3] << 24);
+}
+
+void write_word_le(unsigned char *buf, size_t offset, uint32_t word)
+{
+	buf[offset+0] = word >> 0;
+	buf[offset+1] = word >> 8;
+	buf[offset+2] = word >> 16;
+	buf[offset+3] = word >> 24;
+}
+
+static off_t global_crc_offset(const struct fw_layout *layout, off_t size);
+static off_t global_crc_offset(const struct fw_layout *layout, off_t size)
+{
+	return layout->crc_at_end ? size - 4 : 0;
+}
+
+/* Decode / encode a global CRC field in the byte order of the layout */
+static uint32_t get_crc_field(const struct fw_layout *layout, const unsigned char *field);
+static uint32_t get_crc_field(const struct fw_layout *layout, const unsigned char *field)
+{
+	if (layout->crc_big_endian)
+		return ((uint32_t) field[0] << 24) | (field[1] << 16) | (field[2] << 8) | field[3];
+	return read_word_le(field, 0);
+}
+
+static void put_crc_field(const struct fw_layout *layout, unsigned char *field, uint32_t crc);
+static void put_crc_field(const struct fw_layout *layout, unsigned char *field, uint32_t crc)
+{
+	if (layout->crc_big_endian) {
+		field[0] = crc >> 24;
+		field[1] = crc >> 16;
+		field[2] = crc >> 8;
+		field[3] = crc >> 0;
+	} else {
+		write_word_le(field, 0, crc);
+	}
+}
+
+/* The global CRC stored in an image of size bytes */
+uint32_t read_global_crc(const struct fw_layout *layout, const unsigned char *buf, size_t size)
+{
+	return get_crc_field(layout, buf + global_crc_offset(layout, size));
+}
+
+void write_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size, uint32_t crc)
+{
+	put_crc_field(layout, buf + global_crc_offset(layout, size), crc);
+}
+
+/* The global CRC an image of size bytes should have */
+unsigned int get_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size)
+{
+	if ((off_t) size < layout->crc_start + layout->crc_trim) {
+		printf("Invalid firmware size: %zu\n", size);
+		return 0;
+	}
+
+	return crc32(buf + layout->crc_start, size - layout->crc_start - layout->crc_trim);
+}
+
+/*
+ * CRC the whole image and every section at once on all CPUs, then check
+ * the results in the same order a serial scan would.
+ */
+static int verify_crcs(const struct fw_layout *layout, unsigned char *buf, size_t size,
+		       struct section_info *sections, int num);
+static int verify_crcs(const struct fw_layout *layout, unsigned char *buf, size_t size,
+		       struct section_info *sections, int num)
+{
+	unsigned int global_header_crc, global_actual_crc;
+	struct crc32_job *jobs;
+	int i;
+
+	jobs = calloc(num + 1, sizeof(*jobs));
+	if (!jobs) {
+		printf("Could not allocate %d CRC jobs\n", num + 1);
+		return -1;
+	}
+
+	jobs[0].buf = buf + layout->crc_start;
+	jobs[0].len = size - layout->crc_start - layout->crc_trim;
+
+	for (i = 0; i < num; i++) {
+		jobs[i + 1].buf = buf + sections[i].offset;
+		jobs[i + 1].len = sections[i].length;
+	}
+
+	crc32_parallel(jobs, num + 1);
+
+	global_header_crc = read_global_crc(layout, buf, size);
+	global_actual_crc = jobs[0].crc;
+
+	printf("Global header CRC: %08x\n", global_header_crc);
+	printf("Global actual CRC: %08x (%s)\n", global_actual_crc,
+		(global_header_crc == global_actual_crc) ? "OK" : "MISMATCH!");
+
+	if (global_header_crc != global_actual_crc) {
+		printf("DANGER!!! Firmware global CRC does not match the CRC listed in the header!\n");
+		printf("This is a bad thing. This firmware looks invalid.\n");
+		free(jobs);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		sections[i].actual_crc = jobs[i + 1].crc;
+
+		if (sections[i].header_crc != sections[i].actual_crc) {
+			printf("WARNING!!! CRC MISMATCH WHILE PARSING SECTION %d\n", i);
+			printf("Header CRC = %08x, Actual CRC = %08x\n",
+			       sections[i].header_crc, sections[i].actual_crc);
+			free(jobs);
+			return -1;
+		}
+	}
+
+	free(jobs);
+	return 0;
+}
+
+/*
+ * Read the section headers into a malloc'd table in *out. If verify is
+ * set, the global CRC and every section CRC are checked as well;
+ * otherwise actual_crc is left equal to header_crc.
+ */
+int parse_firmware(const struct fw_layout *layout, unsigned char *buf, size_t size,
+		   struct section_info **out, int verify)
+{
+	struct section_info *output;
+	int num;
+
+	*out = NULL;
+
+	if ((off_t) size < layout->crc_start + layout->crc_trim || size < 4) {
+		printf("Invalid firmware size: %zu\n", size);
+		return -1;
+	}
+
+	num = index_scan_buf(buf, size, &output);
+	if (num == INDEX_SCAN_TRUNCATED) {
+		printf("A section runs past the end of the file\n");
+		return -1;
+	}
+	if (num < 0) {
+		printf("Could not allocate the section table\n");
+		return -1;
+	}
+
+	if (verify && verify_crcs(layout, buf, size, output, num)) {
+		free(output);
+		return -1;
+	}
+
+	*out = output;
+	return num;
+}
+
+/*
+ * Derive the global CRC of the image from its old value after one section
+ * (and the CRC field in its header) has been rewritten in place, so that
+ * only the section itself has to be read. section->actual_crc must still
+ * hold the CRC of the section contents from before the replacement.
+ */
+unsigned int update_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size,
+			       unsigned int global_crc, struct section_info *section,
+			       unsigned int new_crc)
+{
+	unsigned char old_field[4], new_field[4];
+	off_t field_offset = section->offset - 0x100;
+	off_t crc_end = size - layout->crc_trim;
+
+	/* Header CRC or section outside of the globally checksummed range; do it the slow way */
+	if (field_offset < layout->crc_start ||
+	    section->offset + (off_t) section->length > crc_end)
+		return get_global_crc(layout, buf, size);
+
+	global_crc = crc32_replace(global_crc, section->actual_crc, new_crc,
+				   crc_end - (section->offset + section->length));
+
+	write_word_le(old_field, 0, section->actual_crc);
+	write_word_le(new_field, 0, new_crc);
+
+	return crc32_replace(global_crc, crc32(old_field, 4), crc32(new_field, 4),
+			     crc_end - (field_offset + 4));
+}
+
+/*
+ * parse_firmware() with verification, unless the section index cache
+ * already holds a verified table for this exact, unchanged image.
+ */
+int load_firmware(const struct fw_layout *layout, const char *fname, unsigned char *buf,
+		  size_t size, struct section_info **output)
+{
+	int num;
+
+	num = index_load(fname, layout->index_flags, output);
+	if (num > 0) {
+		printf("Using verified section index from a previous run (--revalidate to recheck)\n");
+		return num;
+	}
+	if (num == 0)
+		free(*output);
+
+	num = parse_firmware(layout, buf, size, output, 1);
+	if (num > 0)
+		index_save(fname, layout->index_flags, *output, num);
+
+	return num;
+}
+
+/* Strip --stream out of argv; returns whether it was given */
+int stream_option(int *argc, char **argv)
+{
+	int stream = 0;
+	int i, j;
+
+	for (i = 1, j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--stream") == 0)
+			stream = 1;
+		else
+			argv[j++] = argv[i];
+	}
+	*argc = j;
+	argv[j] = NULL;
+
+	return stream;
+}
+
+/* Read a whole line from stdin and return whether it started with 'y' */
+static int ask_yes(void);
+static int ask_yes(void)
+{
+	int answer, c;
+
+	answer = c = getchar();
+	while (c != '\n' && c != EOF)
+		c = getchar();
+
+	return answer == 'y';
+}
+
+/*
+ * Make sure a replacement can go into the firmware, asking the user
+ * whether zero-padding a short replacement is okay.
+ */
+int check_replacement(struct replacement *r, struct section_info *sections,
+		      int num_sections, const char *fname)
+{
+	int target_section = r->section;
+	size_t replacement_size = r->size;
+
+	if (target_section < 0 || target_section >= num_sections) {
+		printf("This firmware file (%s) only contains %d sections, and you are\n", fname, num_sections);
+		printf("trying to replace section %d (and they are numbered from 0).\n", target_section);
+		printf("Are you sure you know what you are doing?\n");
+		return -1;
+	}
+	
+	printf("Okay. Trying to replace section_%d with %s\n", target_section, r->fname);
+	
+	if (sections[target_section].length > replacement_size) {
+		printf("\n******************************************************************************\n");
+		printf("WARNING!! The replacement section is smaller than the section in the firmware.\n");
+		printf("In the firmware, section_%d is %zu bytes long.\n",
+		       target_section, sections[target_section].length);
+		printf("Your replacement file for section_%d is only %zu bytes long.\n",
+		       target_section, replacement_size);
+		printf("Your replacement section is smaller than the target section by %zu bytes.\n",
+			sections[target_section].length - replacement_size);
+		printf("\nThis might not necessarily be a bad thing, depending on what you are doing.\n");
+		printf("If you continue, the section will be zero-padded to the expected length.\n");
+		printf("******************************************************************************\n");
+		printf("Would you like to proceed? (y/n)\n");
+		
+		if (!ask_yes()) {
+			printf("Operation aborted by user\n");
+			return -1;
+		}
+	}
+	
+	if (sections[target_section].length < replacement_size) {
+		printf("\n**************************************************************\n");
+		printf("ERROR!! The replacement section will not fit into the firmware.\n");
+		printf("Your replacement file for section_%d has length %zu bytes.\n", target_section, replacement_size);
+		printf("In the firmware, this section is only %zu bytes long.\n", sections[target_section].length);
+		printf("Your replacement section is too long by %zu bytes.\n",
+			replacement_size - sections[target_section].length);
+		printf("This will not work.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the patched image out as a clone of the original firmware, so that
+ * only the replaced sections, their CRC fields and the global CRC have to
+ * be written. On a CoW filesystem the rest costs nothing.
+ */
+int save_patched(const struct fw_layout *layout, const char *fname, const char *output_name,
+		 unsigned char *buf, size_t size, struct section_info *sections,
+		 struct replacement *replacements, int num_replacements)
+{
+	struct section_info *s;
+	off_t crc_offset = global_crc_offset(layout, size);
+	int fd, created, i, ret = 0;
+
+	fd = clone_file(fname, output_name, &created);
+	if (fd < 0)
+		return -1;
+
+	for (i = 0; i < num_replacements && !ret; i++) {
+		s = &sections[replacements[i].section];
+		ret = pwrite_all(fd, buf + s->offset - 0x100, 4, s->offset - 0x100) ||
+		      pwrite_all(fd, buf + s->offset, s->length, s->offset);
+	}
+
+	if (!ret)
+		ret = pwrite_all(fd, buf + crc_offset, 4, crc_offset);
+
+	if (close(fd))
+		ret = -1;
+
+	/* Patching in place, the output is the original image; never remove that */
+	if (ret && created)
+		unlink(output_name);
+
+	return ret ? -1 : 0;
+}
+
+void print_sections(struct section_info *sections, int num_sections)
+{
+	int i;
+	printf("Section\t\t  Offset\t  Length\t     CRC\n");
+	printf("========================================================\n");
+	for (i = 0; i < num_sections; i++) {
+		printf("section_%d\t%8lld\t%8zu\t%08x (%s)\n",
+		       i, (long long) sections[i].offset, sections[i].length, sections[i].header_crc,
+			(sections[i].header_crc == sections[i].actual_crc) ? "OK" : "MISMATCH!"
+		);
+	}
+}
+
+/*
+ * Streaming mode. Rather than mapping the whole firmware, copy it to the
+ * output through a fixed size buffer, splicing the replacement sections
+ * in and computing every CRC on the way. The section CRC fields come
+ * before the data they cover, so they are back-patched with pwrite() at
+ * the end, along with the global CRC. Memory use stays at a few MB
+ * however large the firmware is.
+ */
+#define STREAM_BUF_SIZE	(1024 * 1024)
+
+/* Update *crc with the part of [start, end) held in buf, which covers [pos, pos + n) */
+static void crc_overlap(unsigned long *crc, off_t start, off_t end,
+			const unsigned char *buf, off_t pos, size_t n);
+static void crc_overlap(unsigned long *crc, off_t start, off_t end,
+			const unsigned char *buf, off_t pos, size_t n)
+{
+	off_t a = start > pos ? start : pos;
+	off_t b = end < pos + (off_t) n ? end : pos + (off_t) n;
+
+	if (a < b)
+		*crc = crc32_update(*crc, buf + (a - pos), b - a);
+}
+
+/* Overwrite the part of section s held in buf with its (zero-padded) replacement */
+static int splice_replacement(struct replacement *r, const struct section_info *s,
+			      unsigned char *buf, off_t pos, size_t n);
+static int splice_replacement(struct replacement *r, const struct section_info *s,
+			      unsigned char *buf, off_t pos, size_t n)
+{
+	off_t start = s->offset, end = start + s->length;
+	off_t a = start > pos ? start : pos;
+	off_t b = end < pos + (off_t) n ? end : pos + (off_t) n;
+	off_t c = start + r->size;
+
+	if (a >= b)
+		return 0;
+
+	if (c > b)
+		c = b;
+
+	if (c > a && fread(buf + (a - pos), c - a, 1, r->fd) != 1) {
+		printf("Error reading replacement section file %s\n", r->fname);
+		return -1;
+	}
+
+	if (c < a)
+		c = a;
+	memset(buf + (c - pos), 0, b - c);
+
+	return 0;
+}
+
+int stream_firmware(const struct fw_layout *layout, const char *fname,
+		    struct replacement *replacements, int num_replacements, const char *oname)
+{
+	struct section_info *sections = NULL;
+	struct replacement **by_section = NULL, *r;
+	unsigned long *old_crcs = NULL, *new_crcs = NULL;
+	unsigned long old_global_crc = 0, new_global_crc = 0;
+	unsigned int header_global_crc;
+	off_t field_offset;
+	unsigned char header_global[4], old_field[4], new_field[4];
+	unsigned char *buf = NULL;
+	char tmp_path[PATH_MAX + 8];
+	struct stat st;
+	FILE *in_fd;
+	int out_fd = -1, created = 0;
+	int num_sections, i, cur = 0, ret = -1;
+	off_t pos, size, global_start, global_end, crc_offset;
+	size_t n;
+
+	in_fd = fopen(fname, "rb");
+	if (!in_fd || fstat(fileno(in_fd), &st)) {
+		printf("Could not open original firmware file %s. Exiting.\n", fname);
+		return -1;
+	}
+
+	size = st.st_size;
+	if (size < layout->crc_start + layout->crc_trim || size < 4) {
+		printf("Invalid firmware size: %lld\n", (long long) size);
+		goto out;
+	}
+	global_start = layout->crc_start;
+	global_end = size - layout->crc_trim;
+	crc_offset = global_crc_offset(layout, size);
+
+	printf("\nDecoding section headers of %s...\n", fname);
+	num_sections = index_load(fname, 0, &sections);
+	if (num_sections < 0)
+		num_sections = index_scan(in_fd, &sections);
+	if (num_sections <= 0) {
+		printf("This firmware looks invalid. Exiting.\n");
+		goto out;
+	}
+
+	for (i = 0; i < num_sections; i++) {
+		if (sections[i].offset + (off_t) sections[i].length > size) {
+			printf("Section %d runs past the end of the file\n", i);
+			goto out;
+		}
+	}
+
+	printf("\nFound %d sections in file %s (CRCs are checked while copying):\n", num_sections, fname);
+	print_sections(sections, num_sections);
+	printf("\n");
+
+	by_section = calloc(num_sections, sizeof(*by_section));
+	old_crcs = calloc(num_sections, sizeof(*old_crcs));
+	new_crcs = calloc(num_sections, sizeof(*new_crcs));
+	buf = malloc(STREAM_BUF_SIZE);
+	if (!by_section || !old_crcs || !new_crcs || !buf) {
+		printf("Could not allocate stream buffers\n");
+		goto out;
+	}
+
+	for (i = 0; i < num_replacements; i++) {
+		r = &replacements[i];
+		r->fd = fopen(r->fname, "rb");
+		if (!r->fd || fstat(fileno(r->fd), &st)) {
+			printf("Could not read in replacement section file %s. Exiting.\n", r->fname);
+			goto out;
+		}
+		r->size = st.st_size;
+
+		if (check_replacement(r, sections, num_sections, fname))
+			goto out;
+
+		by_section[r->section] = r;
+	}
+
+	/* oname may well be fname; it is only replaced once the copy checks out */
+	out_fd = open_temp(oname, tmp_path, sizeof(tmp_path));
+	if (out_fd < 0)
+		goto out;
+	created = 1;
+
+	printf("\nCopying firmware to %s...\n", oname);
+	fseeko(in_fd, 0, SEEK_SET);
+	stats_begin("stream");
+
+	for (pos = 0; pos < size; pos += n) {
+		n = fread(buf, 1, STREAM_BUF_SIZE, in_fd);
+		if (n == 0) {
+			printf("Error reading %s\n", fname);
+			goto out;
+		}
+
+		for (i = 0; i < 4; i++)
+			if (crc_offset + i >= pos && crc_offset + i < pos + (off_t) n)
+				header_global[i] = buf[crc_offset + i - pos];
+
+		crc_overlap(&old_global_crc, global_start, global_end, buf, pos, n);
+
+		for (i = cur; i < num_sections && sections[i].offset < pos + (off_t) n; i++) {
+			crc_overlap(&old_crcs[i], sections[i].offset,
+				    sections[i].offset + sections[i].length, buf, pos, n);
+
+			if (!by_section[i])
+				continue;
+
+			if (splice_replacement(by_section[i], &sections[i], buf, pos, n))
+				goto out;
+
+			crc_overlap(&new_crcs[i], sections[i].offset,
+				    sections[i].offset + sections[i].length, buf, pos, n);
+		}
+
+		while (cur < num_sections && sections[cur].offset + (off_t) sections[cur].length <= pos + (off_t) n)
+			cur++;
+
+		crc_overlap(&new_global_crc, global_start, global_end, buf, pos, n);
+
+		if (pwrite_all(out_fd, buf, n, pos)) {
+			printf("Error writing %s\n", oname);
+			goto out;
+		}
+	}
+
+	stats_end("stream", size);
+
+	header_global_crc = get_crc_field(layout, header_global);
+	printf("Global header CRC: %08x\n", header_global_crc);
+	printf("Global actual CRC: %08lx (%s)\n", old_global_crc,
+		(header_global_crc == old_global_crc) ? "OK" : "MISMATCH!");
+
+	if (header_global_crc != old_global_crc) {
+		printf("DANGER!!! Firmware global CRC does not match the CRC listed in the header!\n");
+		printf("This is a bad thing. This firmware looks invalid.\n");
+		goto out;
+	}
+
+	for (i = 0; i < num_sections; i++) {
+		if (sections[i].header_crc != old_crcs[i]) {
+			printf("WARNING!!! CRC MISMATCH WHILE PARSING SECTION %d\n", i);
+			printf("Header CRC = %08x, Actual CRC = %08lx\n",
+			       sections[i].header_crc, old_crcs[i]);
+			goto out;
+		}
+	}
+
+	index_save(fname, layout->index_flags, sections, num_sections);
+
+	/* Back-patch the section CRCs, folding each change into the global CRC */
+	for (i = 0; i < num_sections; i++) {
+		if (!by_section[i])
+			continue;
+
+		printf("New section_%d CRC: %08lx\n", i, new_crcs[i]);
+
+		field_offset = sections[i].offset - 0x100;
+		write_word_le(old_field, 0, sections[i].header_crc);
+		write_word_le(new_field, 0, new_crcs[i]);
+
+		if (pwrite_all(out_fd, new_field, 4, field_offset)) {
+			printf("Error writing %s\n", oname);
+			goto out;
+		}
+
+		if (field_offset >= global_start && field_offset + 4 <= global_end)
+			new_global_crc = crc32_replace(new_global_crc, crc32(old_field, 4),
+						       crc32(new_field, 4),
+						       global_end - (field_offset + 4));
+
+		sections[i].header_crc = new_crcs[i];
+		sections[i].actual_crc = new_crcs[i];
+	}
+
+	printf("New global CRC: %08lx\n", new_global_crc);
+	put_crc_field(layout, new_field, new_global_crc);
+	if (pwrite_all(out_fd, new_field, 4, crc_offset)) {
+		printf("Error writing %s\n", oname);
+		goto out;
+	}
+
+	ret = close(out_fd);
+	out_fd = -1;
+	if (ret || rename(tmp_path, oname)) {
+		printf("Error writing %s\n", oname);
+		ret = -1;
+		goto out;
+	}
+
+	index_save(oname, 0, sections, num_sections);
+	printf("Done.\n");
+
+out:
+	if (out_fd >= 0)
+		close(out_fd);
+	if (ret && created)
+		unlink(tmp_path);
+	for (i = 0; i < num_replacements; i++)
+		if (replacements[i].fd)
+			fclose(replacements[i].fd);
+	free(buf);
+	free(new_crcs);
+	free(old_crcs);
+	free(by_section);
+	free(sections);
+	fclose(in_fd);
+	return ret;
+}
@@ -0,0 +1,54 @@
+#ifndef SECPATCH_H
+#define SECPATCH_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fwindex.h"
+
+/*
+ * Where a firmware layout keeps its global CRC: it covers
+ * [crc_start, size - crc_trim) and is stored in the first or last word.
+ */
+struct fw_layout {
+	off_t crc_start;
+	off_t crc_trim;
+	int crc_at_end;
+	int crc_big_endian;
+	unsigned int index_flags;	/* INDEX_VERIFIED_* for a checked image */
+};
+
+struct replacement {
+	const char *fname;
+	int section;
+	unsigned char *buf;
+	size_t map_size;
+	size_t size;
+	FILE *fd;		/* streaming mode only */
+};
+
+uint32_t read_word_le(const unsigned char *buf, size_t offset);
+void write_word_le(unsigned char *buf, size_t offset, uint32_t word);
+uint32_t read_global_crc(const struct fw_layout *layout, const unsigned char *buf, size_t size);
+void write_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size, uint32_t crc);
+unsigned int get_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size);
+int parse_firmware(const struct fw_layout *layout, unsigned char *buf, size_t size,
+		   struct section_info **out, int verify);
+unsigned int update_global_crc(const struct fw_layout *layout, unsigned char *buf, size_t size,
+			       unsigned int global_crc, struct section_info *section,
+			       unsigned int new_crc);
+int load_firmware(const struct fw_layout *layout, const char *fname, unsigned char *buf,
+		  size_t size, struct section_info **output);
+
+int stream_option(int *argc, char **argv);
+void print_sections(struct section_info *sections, int num_sections);
+int check_replacement(struct replacement *r, struct section_info *sections,
+		      int num_sections, const char *fname);
+int save_patched(const struct fw_layout *layout, const char *fname, const char *output_name,
+		 unsigned char *buf, size_t size, struct section_info *sections,
+		 struct replacement *replacements, int num_replacements);
+int stream_firmware(const struct fw_layout *layout, const char *fname,
+		    struct replacement *replacements, int num_replacements, const char *oname);
+
+#endif /* SECPATCH_H */
@@ -0,0 +1,144 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/* Plain FIPS 180-4 SHA-256, used to name objects in the section store */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t h[8], const unsigned char *p);
+static void sha256_block(uint32_t h[8], const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16 |
+		       (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3];
+	e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((e & f) ^ (~e & g)) +
+		     sha256_k[i] + w[i];
+		t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+	h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->h, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->fill = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data, size_t len)
+{
+	size_t n;
+
+	ctx->len += len;
+
+	if (ctx->fill) {
+		n = 64 - ctx->fill < len ? 64 - ctx->fill : len;
+		memcpy(ctx->buf + ctx->fill, data, n);
+		ctx->fill += n;
+		data += n;
+		len -= n;
+		if (ctx->fill < 64)
+			return;
+		sha256_block(ctx->h, ctx->buf);
+		ctx->fill = 0;
+	}
+
+	for (; len >= 64; data += 64, len -= 64)
+		sha256_block(ctx->h, data);
+
+	memcpy(ctx->buf, data, len);
+	ctx->fill = len;
+}
+
+void sha256_final(struct sha256_ctx *ctx, unsigned char out[SHA256_LEN])
+{
+	uint64_t bits = ctx->len * 8;
+	int i;
+
+	ctx->buf[ctx->fill++] = 0x80;
+	if (ctx->fill > 56) {
+		memset(ctx->buf + ctx->fill, 0, 64 - ctx->fill);
+		sha256_block(ctx->h, ctx->buf);
+		ctx->fill = 0;
+	}
+	memset(ctx->buf + ctx->fill, 0, 56 - ctx->fill);
+
+	for (i = 0; i < 8; i++)
+		ctx->buf[56 + i] = bits >> (56 - i * 8);
+	sha256_block(ctx->h, ctx->buf);
+
+	for (i = 0; i < 8; i++) {
+		out[i * 4 + 0] = ctx->h[i] >> 24;
+		out[i * 4 + 1] = ctx->h[i] >> 16;
+		out[i * 4 + 2] = ctx->h[i] >> 8;
+		out[i * 4 + 3] = ctx->h[i];
+	}
+}
+
+/* SHA-256 of a buffer as a NUL-terminated lowercase hex string */
+void sha256_hex(const unsigned char *data, size_t len, char out[SHA256_HEX_LEN])
+{
+	struct sha256_ctx ctx;
+	unsigned char digest[SHA256_LEN];
+	int i;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+
+	for (i = 0; i < SHA256_LEN; i++)
+		sprintf(out + i * 2, "%02x", digest[i]);
+}
@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN	32
+#define SHA256_HEX_LEN	(SHA256_LEN * 2 + 1)
+
+struct sha256_ctx {
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char buf[64];
+	size_t fill;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const unsigned char *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, unsigned char out[SHA256_LEN]);
+void sha256_hex(const unsigned char *data, size_t len, char out[SHA256_HEX_LEN]);
+
+#endif /* SHA256_H */
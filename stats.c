@@ -0,0 +1,178 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Per-phase wall clock time, CPU time (of all threads), bytes processed
+ * and peak RSS. The report is a table for humans followed by a single
+ * "stats:" line of key=value pairs for scripts to pick up.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+#define MAX_PHASES	16
+
+struct phase {
+	const char *name;
+	double wall, cpu;		/* accumulated seconds */
+	double wall_start, cpu_start;
+	unsigned long long bytes;
+};
+
+static int stats_enabled;
+static const char *stats_tool;
+static double stats_wall_start;
+static struct phase phases[MAX_PHASES];
+static int num_phases;
+
+static double wall_time(void);
+static double wall_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_time(void);
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* Peak resident set size in KB */
+static long peak_rss(void);
+static long peak_rss(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef _MACOSX
+	return ru.ru_maxrss / 1024;	/* bytes on OS X */
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+static double mb_per_sec(unsigned long long bytes, double seconds);
+static double mb_per_sec(unsigned long long bytes, double seconds)
+{
+	return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+static struct phase *find_phase(const char *name);
+static struct phase *find_phase(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_phases; i++)
+		if (strcmp(phases[i].name, name) == 0)
+			return &phases[i];
+
+	if (num_phases == MAX_PHASES)
+		return NULL;
+
+	phases[num_phases].name = name;
+	return &phases[num_phases++];
+}
+
+static void stats_report(void);
+static void stats_report(void)
+{
+	double wall = wall_time() - stats_wall_start;
+	double cpu = cpu_time();
+	long rss = peak_rss();
+	struct phase *p;
+	int i;
+
+	fprintf(stderr, "\n%-12s %10s %10s %14s %10s\n", "Phase", "Wall (s)", "CPU (s)", "Bytes", "MB/s");
+	for (i = 0; i < num_phases; i++) {
+		p = &phases[i];
+		fprintf(stderr, "%-12s %10.3f %10.3f %14llu %10.1f\n",
+			p->name, p->wall, p->cpu, p->bytes, mb_per_sec(p->bytes, p->wall));
+	}
+	fprintf(stderr, "%-12s %10.3f %10.3f\n", "total", wall, cpu);
+	fprintf(stderr, "Peak RSS: %ld KB\n", rss);
+
+	fprintf(stderr, "stats: tool=%s wall=%.6f cpu=%.6f peak_rss_kb=%ld",
+		stats_tool, wall, cpu, rss);
+	for (i = 0; i < num_phases; i++) {
+		p = &phases[i];
+		fprintf(stderr, " %s.wall=%.6f %s.cpu=%.6f %s.bytes=%llu %s.mbps=%.1f",
+			p->name, p->wall, p->name, p->cpu, p->name, p->bytes,
+			p->name, mb_per_sec(p->bytes, p->wall));
+	}
+	fprintf(stderr, "\n");
+}
+
+/* Strip --stats from the command line and start the clock if it was there */
+void stats_init(int *argc, char **argv)
+{
+	const char *slash;
+	int i, j;
+
+	for (i = 1, j = 1; i < *argc; i++) {
+		if (strcmp(argv[i], "--stats") == 0)
+			stats_enabled = 1;
+		else
+			argv[j++] = argv[i];
+	}
+	*argc = j;
+	argv[j] = NULL;
+
+	if (!stats_enabled)
+		return;
+
+	slash = strrchr(argv[0], '/');
+	stats_tool = slash ? slash + 1 : argv[0];
+	stats_wall_start = wall_time();
+	atexit(stats_report);
+}
+
+void stats_begin(const char *phase)
+{
+	struct phase *p;
+
+	if (!stats_enabled || !(p = find_phase(phase)))
+		return;
+
+	p->wall_start = wall_time();
+	p->cpu_start = cpu_time();
+}
+
+void stats_end(const char *phase, unsigned long long bytes)
+{
+	struct phase *p;
+
+	if (!stats_enabled || !(p = find_phase(phase)))
+		return;
+
+	p->wall += wall_time() - p->wall_start;
+	p->cpu += cpu_time() - p->cpu_start;
+	p->bytes += bytes;
+}
@@ -0,0 +1,13 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+/*
+ * Optional --stats instrumentation. Time spent between stats_begin() and
+ * stats_end() is added up per named phase; a report goes to stderr when
+ * the program exits. Both calls do nothing unless --stats was given.
+ */
+void stats_init(int *argc, char **argv);
+void stats_begin(const char *phase);
+void stats_end(const char *phase, unsigned long long bytes);
+
+#endif /* STATS_H */
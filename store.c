@@ -0,0 +1,347 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Content-addressed store for extracted sections and romfs files.
+ *
+ * Every distinct blob is kept once, as objects/xx/yyyy... named by its
+ * SHA-256, and extracted files are hard links to their object. An index
+ * file lists the length, CRC and hash of every object. A blob whose
+ * (length, CRC) is not in the index is new and gets hashed and written;
+ * otherwise it is compared with the candidate objects byte for byte, so
+ * the common case of an unchanged blob never needs the strong hash.
+ *
+ * All entry points may be called from several threads at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "fileio.h"
+#include "store.h"
+
+#define STORE_HASH_BITS	16
+#define STORE_HASH_SIZE	(1 << STORE_HASH_BITS)
+
+struct store_object {
+	size_t len;
+	unsigned long crc;
+	char hash[SHA256_HEX_LEN];
+	struct store_object *next;	/* hash chain */
+};
+
+struct store {
+	char *dir;
+	FILE *index;
+	pthread_mutex_t lock;
+	struct store_object *table[STORE_HASH_SIZE];
+	int new_objects, dup_objects;
+	unsigned long long new_bytes, dup_bytes;
+};
+
+static unsigned int store_hash(size_t len, unsigned long crc);
+static unsigned int store_hash(size_t len, unsigned long crc)
+{
+	return (uint32_t) ((crc ^ len) * 2654435761U) >> (32 - STORE_HASH_BITS);
+}
+
+/* Add an object to the in-memory index. Call with st->lock held. */
+static int store_insert(struct store *st, size_t len, unsigned long crc, const char *hash);
+static int store_insert(struct store *st, size_t len, unsigned long crc, const char *hash)
+{
+	struct store_object *o;
+	unsigned int h = store_hash(len, crc);
+
+	for (o = st->table[h]; o; o = o->next)
+		if (o->len == len && strcmp(o->hash, hash) == 0)
+			return 0;
+
+	o = malloc(sizeof(*o));
+	if (!o)
+		return -1;
+
+	o->len = len;
+	o->crc = crc;
+	strcpy(o->hash, hash);
+	o->next = st->table[h];
+	st->table[h] = o;
+	return 1;
+}
+
+static void object_path(const struct store *st, const char *hash, char *path, size_t size);
+static void object_path(const struct store *st, const char *hash, char *path, size_t size)
+{
+	snprintf(path, size, "%s/objects/%.2s/%s", st->dir, hash, hash + 2);
+}
+
+struct store *store_open(const char *dir)
+{
+	struct store *st;
+	char path[PATH_MAX], hash[SHA256_HEX_LEN];
+	unsigned long long len;
+	unsigned long crc;
+	FILE *fd;
+
+	st = calloc(1, sizeof(*st));
+	if (!st)
+		return NULL;
+
+	st->dir = strdup(dir);
+	pthread_mutex_init(&st->lock, NULL);
+
+	snprintf(path, sizeof(path), "%s/objects", dir);
+	if (!st->dir || (mkdir(dir, 0755) && errno != EEXIST) ||
+	    (mkdir(path, 0755) && errno != EEXIST)) {
+		printf("Could not create store %s\n", dir);
+		goto fail;
+	}
+
+	snprintf(path, sizeof(path), "%s/index", dir);
+	fd = fopen(path, "r");
+	if (fd) {
+		while (fscanf(fd, "%llu %lx %64s", &len, &crc, hash) == 3)
+			if (strlen(hash) == SHA256_HEX_LEN - 1)
+				store_insert(st, len, crc, hash);
+		fclose(fd);
+	}
+
+	st->index = fopen(path, "a");
+	if (!st->index) {
+		printf("Could not write store index %s\n", path);
+		goto fail;
+	}
+
+	return st;
+
+fail:
+	free(st->dir);
+	free(st);
+	return NULL;
+}
+
+/* Whether the object named hash holds exactly buf */
+static int object_matches(const struct store *st, const char *hash,
+			  const unsigned char *buf, size_t len);
+static int object_matches(const struct store *st, const char *hash,
+			  const unsigned char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	unsigned char *map;
+	size_t size;
+	struct stat s;
+	int ret;
+
+	object_path(st, hash, path, sizeof(path));
+	if (stat(path, &s) || (size_t) s.st_size != len)
+		return 0;
+
+	/* map_file() does not do empty files */
+	if (len == 0)
+		return 1;
+
+	map = map_file(path, &size, 0);
+	if (!map)
+		return 0;
+
+	ret = size == len && memcmp(map, buf, len) == 0;
+	unmap_file(map, size);
+	return ret;
+}
+
+/* Write a new object, via a temporary file so it appears atomically */
+static int write_object(const struct store *st, const char *hash,
+			const unsigned char *buf, size_t len);
+static int write_object(const struct store *st, const char *hash,
+			const unsigned char *buf, size_t len)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX + 32];
+	int fd, ret;
+
+	snprintf(path, sizeof(path), "%s/objects/%.2s", st->dir, hash);
+	if (mkdir(path, 0755) && errno != EEXIST)
+		return -1;
+
+	object_path(st, hash, path, sizeof(path));
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d.%lx", path, (int) getpid(),
+		 (unsigned long) pthread_self());
+
+	/* Read-only, since every extracted copy is a hard link to it */
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	if (fd < 0)
+		return -1;
+
+	ret = pwrite_all(fd, buf, len, 0);
+	if (close(fd))
+		ret = -1;
+
+	if (ret || rename(tmp_path, path)) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Make link_path a hard link to the object, or a copy across filesystems */
+static int link_object(const struct store *st, const char *hash, const char *link_path,
+		       const unsigned char *buf, size_t len);
+static int link_object(const struct store *st, const char *hash, const char *link_path,
+		       const unsigned char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	object_path(st, hash, path, sizeof(path));
+	unlink(link_path);
+	if (link(path, link_path) == 0)
+		return 0;
+
+	if (errno != EXDEV)
+		return -1;
+
+	fd = create_file(link_path);
+	if (fd < 0)
+		return -1;
+
+	ret = pwrite_all(fd, buf, len, 0);
+	if (close(fd))
+		ret = -1;
+	return ret;
+}
+
+/*
+ * Put buf in the store, unless it is there already, and make link_path
+ * (if not NULL) point at it. e gets the length, CRC and hash filled in.
+ */
+int store_put(struct store *st, const unsigned char *buf, size_t len,
+	      const char *link_path, struct store_entry *e)
+{
+	struct store_object *o;
+	unsigned long crc = crc32_update(0L, buf, len);
+	char candidates[8][SHA256_HEX_LEN];
+	int i, num = 0, found = 0, ret;
+
+	e->len = len;
+	e->crc = crc;
+
+	pthread_mutex_lock(&st->lock);
+	for (o = st->table[store_hash(len, crc)]; o && num < 8; o = o->next)
+		if (o->len == len && o->crc == crc)
+			strcpy(candidates[num++], o->hash);
+	pthread_mutex_unlock(&st->lock);
+
+	for (i = 0; i < num && !found; i++) {
+		if (object_matches(st, candidates[i], buf, len)) {
+			strcpy(e->hash, candidates[i]);
+			found = 1;
+		}
+	}
+
+	if (!found) {
+		sha256_hex(buf, len, e->hash);
+		if (object_matches(st, e->hash, buf, len)) {
+			found = 1;	/* stored, but missing from the index */
+		} else if (write_object(st, e->hash, buf, len)) {
+			printf("Could not write object %s to the store\n", e->hash);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&st->lock);
+	ret = store_insert(st, len, crc, e->hash);
+	if (ret > 0) {
+		fprintf(st->index, "%llu %08lx %s\n", (unsigned long long) len, crc, e->hash);
+		fflush(st->index);
+	}
+	if (found) {
+		st->dup_objects++;
+		st->dup_bytes += len;
+	} else {
+		st->new_objects++;
+		st->new_bytes += len;
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	if (ret < 0)
+		return -1;
+
+	if (link_path && link_object(st, e->hash, link_path, buf, len)) {
+		printf("Could not link %s into the store\n", link_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* List what went where: one "hash length crc name" line per entry */
+int store_write_manifest(const char *fname, const struct store_entry *entries, int num)
+{
+	FILE *fd;
+	int i;
+
+	fd = fopen(fname, "w");
+	if (!fd) {
+		printf("Could not write manifest %s\n", fname);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++)
+		fprintf(fd, "%s %llu %08lx %s\n", entries[i].hash,
+			(unsigned long long) entries[i].len, entries[i].crc, entries[i].name);
+
+	if (ferror(fd) | fclose(fd)) {
+		printf("Could not write manifest %s\n", fname);
+		return -1;
+	}
+
+	return 0;
+}
+
+void store_close(struct store *st)
+{
+	struct store_object *o, *next;
+	int i;
+
+	if (!st)
+		return;
+
+	printf("Store %s: %d new objects (%llu bytes), %d already stored (%llu bytes)\n",
+	       st->dir, st->new_objects, st->new_bytes, st->dup_objects, st->dup_bytes);
+
+	for (i = 0; i < STORE_HASH_SIZE; i++) {
+		for (o = st->table[i]; o; o = next) {
+			next = o->next;
+			free(o);
+		}
+	}
+
+	fclose(st->index);
+	pthread_mutex_destroy(&st->lock);
+	free(st->dir);
+	free(st);
+}
@@ -0,0 +1,24 @@
+#ifndef STORE_H
+#define STORE_H 1
+
+#include <stddef.h>
+
+#include "sha256.h"
+
+struct store;
+
+/* One blob placed in the store, as listed in a manifest */
+struct store_entry {
+	const char *name;
+	size_t len;
+	unsigned long crc;
+	char hash[SHA256_HEX_LEN];
+};
+
+struct store *store_open(const char *dir);
+int store_put(struct store *st, const unsigned char *buf, size_t len,
+	      const char *link_path, struct store_entry *e);
+int store_write_manifest(const char *fname, const struct store_entry *entries, int num);
+void store_close(struct store *st);
+
+#endif /* STORE_H */
@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# Check that extracting over the output of an earlier --store run
+# replaces the extracted files instead of writing through their hard
+# links into the store.
+#
+# Usage: ./test-store.sh
+#
+# Normally run through "make check". Sections and romfs files are first
+# extracted with --store, then files with the same names but different
+# contents are written over them by every tool that can; afterwards each
+# object in the store must still hash to its name.
+#
+
+set -e
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/gopro-fw-test.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT INT TERM
+
+FWINDEX_DIR="$WORK/index"
+export FWINDEX_DIR
+
+# quiet <command...>: run the command, only showing its output if it fails
+quiet() {
+	if ! "$@" > "$WORK/last.log" 2>&1; then
+		echo "FAILED: $*"
+		tail -5 "$WORK/last.log"
+		exit 1
+	fi
+}
+
+# check_store <tool>: every object in the store must still hash to its name
+check_store() {
+	objects=0
+	for f in $(cd "$WORK" && find store/objects -type f); do
+		hash=$(sha256sum "$WORK/$f" | cut -c 1-64)
+		name=$(echo "$f" | sed 's|^store/objects/\(..\)/|\1|')
+		if [ "$hash" != "$name" ]; then
+			echo "FAILED: $1 overwrote store object $name"
+			exit 1
+		fi
+		objects=$((objects + 1))
+	done
+
+	if [ "$objects" -eq 0 ]; then
+		echo "FAILED: nothing was put in the store"
+		exit 1
+	fi
+}
+
+cd "$WORK"
+
+# Two of each kind of image, with the same names but different contents
+quiet "$TOOLS/fwgen" h4 old.bin 1
+quiet "$TOOLS/fwgen" h4 new.bin 2
+mkdir -p old/sub new/sub
+for f in a b sub/c; do
+	echo "old $f" > "old/$f"
+	echo "new $f" > "new/$f"
+done
+quiet "$TOOLS/goprom" --build old old.rom
+quiet "$TOOLS/goprom" --build new new.rom
+
+mkdir fw rom
+cd "$WORK/fw"
+quiet "$TOOLS/fwunpacker" --store ../store ../old.bin
+quiet "$TOOLS/fwunpacker" ../new.bin
+check_store "fwunpacker"
+quiet "$TOOLS/fwunpacker" --store ../store ../old.bin
+quiet "$TOOLS/fwunpacker" -j 0 ../new.bin
+check_store "fwunpacker -j 0"
+quiet "$TOOLS/fwunpacker" --store ../store ../old.bin
+yes | quiet "$TOOLS/h4-section-patch" ../new.bin ../new/a 1 section_0
+check_store "h4-section-patch"
+cd "$WORK/rom"
+quiet "$TOOLS/goprom" --store ../store --extract-all ../old.rom
+quiet "$TOOLS/goprom" --extract-all ../new.rom
+check_store "goprom --extract-all"
+cmp -s sub/c ../new/sub/c || { echo "FAILED: sub/c was not replaced"; exit 1; }
+quiet "$TOOLS/goprom" --store ../store --extract-all ../old.rom
+quiet "$TOOLS/goprom" --extract ../new.rom '*'
+check_store "goprom --extract"
+
+echo "test-store: OK ($objects objects intact)"
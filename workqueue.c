@@ -0,0 +1,121 @@
+/*
+ *  Copyright (c) 2026, gopro-fw-tools contributors
+ *
+ *   This program is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Minimal thread pool: a fixed set of workers pull job indices from a
+ * shared counter until every job has been handed out. Jobs are small and
+ * independent, so this balances load well without per-worker queues.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "workqueue.h"
+
+#define MAX_THREADS	64
+
+struct work_queue {
+	pthread_mutex_t lock;
+	int next_job;
+	int njobs;
+	int failed;
+	work_fn fn;
+	void *ctx;
+};
+
+/* Number of worker threads to use by default: one per online CPU */
+int work_nthreads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+	if (n > MAX_THREADS)
+		return MAX_THREADS;
+	return n;
+}
+
+static void *work_thread(void *arg);
+static void *work_thread(void *arg)
+{
+	struct work_queue *q = arg;
+	int job, ret;
+
+	while (1) {
+		pthread_mutex_lock(&q->lock);
+		job = q->next_job++;
+		pthread_mutex_unlock(&q->lock);
+
+		if (job >= q->njobs)
+			break;
+
+		ret = q->fn(q->ctx, job);
+
+		if (ret) {
+			pthread_mutex_lock(&q->lock);
+			q->failed = 1;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Run fn(ctx, job) for every job in [0, njobs) on up to nthreads threads
+ * (0 means one per CPU) and wait for all of them. Returns 0 if every job
+ * succeeded, -1 otherwise.
+ */
+int work_run(int nthreads, int njobs, work_fn fn, void *ctx)
+{
+	pthread_t threads[MAX_THREADS];
+	struct work_queue q;
+	int i, started = 0;
+
+	if (nthreads <= 0)
+		nthreads = work_nthreads();
+	if (nthreads > MAX_THREADS)
+		nthreads = MAX_THREADS;
+	if (nthreads > njobs)
+		nthreads = njobs;
+
+	q.next_job = 0;
+	q.njobs = njobs;
+	q.failed = 0;
+	q.fn = fn;
+	q.ctx = ctx;
+	pthread_mutex_init(&q.lock, NULL);
+
+	/* The calling thread is always one of the workers */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, work_thread, &q))
+			break;
+		started++;
+	}
+
+	work_thread(&q);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&q.lock);
+
+	return q.failed ? -1 : 0;
+}
@@ -0,0 +1,13 @@
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H 1
+
+/*
+ * Called once for every job index in [0, njobs). Returning non-zero
+ * marks the run as failed, but the remaining jobs are still executed.
+ */
+typedef int (*work_fn)(void *ctx, int job);
+
+int work_nthreads(void);
+int work_run(int nthreads, int njobs, work_fn fn, void *ctx);
+
+#endif /* WORKQUEUE_H */